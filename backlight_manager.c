@@ -18,6 +18,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
@@ -27,26 +28,50 @@
 #include <signal.h>
 #include <getopt.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <errno.h>
 #include <string.h>
+#include <poll.h>
 #include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <linux/iio/events.h>
+#include <linux/input.h>
+#include <linux/netlink.h>
+
+#include "backlight_manager.h"
 
 #define MAX_PATH_LENGTH 512
 #define PID_FILE_PATH "/tmp/backlight_manager.pid"
 #define FIFO_PATH "/tmp/backlight_manager.pipe"
+#define MAX_EPOLL_EVENTS 16
+#define MAX_PIPE_MESSAGES 64
 
-typedef struct{
-  int brightness_adjustment;
-  bool ambient_mode;
-} PipeData;
+#define MAX_CLIENTS 32
+#define MAX_INPUT_DEVICES 8
+#define MAX_INPUT_EVENTS 64
+#define INPUT_DEVICES_PATH "/dev/input"
+#define MAX_PENDING_EVENTS 16
+#define RING_BATCH (4 * BM_RING_SIZE)
+#define RING_MAX_ADJUSTMENT 100
 
-void signal_handler(int signal) {
-  if (remove(PID_FILE_PATH) == -1) {
-    perror("Error removing the PID file");
-  }
-  exit(0);
-}
+// Structure describing a readiness source of the daemon event loop
+typedef struct {
+  int fd;
+  void (*handler)(void* data, uint32_t events);
+  void* data;
+} EventSource;
 
 // Function to get the path of the brightness sensor
 char* get_sensor_path(const char* devices_path, const char* filename) {
@@ -97,21 +122,510 @@ const char* get_config_file_path() {
   }
 }
 
-// Structure to store configuration data
+// Easing curves of the brightness transition engine
+typedef enum {
+  EASING_LINEAR,
+  EASING_EASE_IN,
+  EASING_EASE_OUT,
+  EASING_EASE_IN_OUT
+} EasingCurve;
+
+// Function to parse the name of an easing curve
+int parse_easing_curve(const char* name) {
+  if (strcmp(name, "linear") == 0) {
+    return EASING_LINEAR;
+  } else if (strcmp(name, "ease-in") == 0) {
+    return EASING_EASE_IN;
+  } else if (strcmp(name, "ease-out") == 0) {
+    return EASING_EASE_OUT;
+  } else if (strcmp(name, "ease-in-out") == 0) {
+    return EASING_EASE_IN_OUT;
+  }
+  fprintf(stderr, "Unknown transition curve: %s\n", name);
+  return EASING_EASE_IN_OUT;
+}
+
+// Reactions of ambient mode to brightness changes made by other programs
+typedef enum {
+  EXTERNAL_REBASE,
+  EXTERNAL_PAUSE,
+  EXTERNAL_OVERRIDE
+} ExternalChangePolicy;
+
+// Function to parse the name of an external change policy
+int parse_external_change(const char* name) {
+  if (strcmp(name, "pause") == 0) {
+    return EXTERNAL_PAUSE;
+  } else if (strcmp(name, "override") == 0) {
+    return EXTERNAL_OVERRIDE;
+  } else if (strcmp(name, "rebase") != 0) {
+    fprintf(stderr, "Unknown external change policy: %s\n", name);
+  }
+  return EXTERNAL_REBASE;
+}
+
+// Stages of the sensor filter chain
+typedef enum {
+  FILTER_SPIKE,
+  FILTER_MEDIAN,
+  FILTER_EMA,
+  FILTER_ASYMMETRIC
+} FilterStage;
+
+#define MAX_FILTER_STAGES 4
+#define MAX_MEDIAN_WINDOW 15
+
+// Structure to store the configuration of the sensor filter chain
+typedef struct {
+  int stages[MAX_FILTER_STAGES];
+  int stage_count;
+  int median_window;
+  int ema_alpha_percent;
+  int brighten_ms;
+  int dim_ms;
+  int spike_percent;
+  int spike_count;
+} FilterConfig;
+
+// Function to parse a comma separated list of filter stages
+void parse_filter_chain(FilterConfig* filter, const char* value) {
+  char chain[256];
+  strncpy(chain, value, sizeof(chain) - 1);
+  chain[sizeof(chain) - 1] = '\0';
+  filter->stage_count = 0;
+  char* saveptr;
+  for (char* name = strtok_r(chain, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+    int stage;
+    if (strcmp(name, "spike") == 0) {
+      stage = FILTER_SPIKE;
+    } else if (strcmp(name, "median") == 0) {
+      stage = FILTER_MEDIAN;
+    } else if (strcmp(name, "ema") == 0) {
+      stage = FILTER_EMA;
+    } else if (strcmp(name, "asymmetric") == 0) {
+      stage = FILTER_ASYMMETRIC;
+    } else if (strcmp(name, "none") == 0) {
+      continue;
+    } else {
+      fprintf(stderr, "Unknown filter stage: %s\n", name);
+      continue;
+    }
+    if (filter->stage_count < MAX_FILTER_STAGES) {
+      filter->stages[filter->stage_count++] = stage;
+    }
+  }
+}
+
+// Kinds of lux to brightness curves
+typedef enum {
+  CURVE_LINEAR,
+  CURVE_POINTS,
+  CURVE_GAMMA
+} CurveType;
+
+#define MAX_CURVE_POINTS 16
+#define CURVE_TABLE_SIZE 256
+
+// Structure to store the configuration of the lux to brightness curve
+typedef struct {
+  int type;
+  int point_count;
+  int point_input[MAX_CURVE_POINTS];
+  int point_percent[MAX_CURVE_POINTS];
+  double gamma;
+  int max_input;
+} CurveConfig;
+
+// Function to parse curve control points in the form lux:percent,lux:percent,...
+void parse_curve_points(CurveConfig* curve, const char* value) {
+  char points[256];
+  strncpy(points, value, sizeof(points) - 1);
+  points[sizeof(points) - 1] = '\0';
+  curve->point_count = 0;
+  char* saveptr;
+  for (char* point = strtok_r(points, ",", &saveptr); point != NULL; point = strtok_r(NULL, ",", &saveptr)) {
+    int input, percent;
+    if (sscanf(point, "%d:%d", &input, &percent) != 2 || input < 0) {
+      fprintf(stderr, "Invalid curve point: %s\n", point);
+      continue;
+    }
+    if (curve->point_count > 0 && input <= curve->point_input[curve->point_count - 1]) {
+      fprintf(stderr, "Curve points must be in ascending order: %s\n", point);
+      continue;
+    }
+    if (curve->point_count < MAX_CURVE_POINTS) {
+      curve->point_input[curve->point_count] = input;
+      curve->point_percent[curve->point_count] = (percent < 0) ? 0 : (percent > 100) ? 100 : percent;
+      curve->point_count++;
+    }
+  }
+  curve->type = (curve->point_count > 0) ? CURVE_POINTS : CURVE_LINEAR;
+}
+
+#define MAX_OUTPUTS BM_PROTOCOL_MAX_OUTPUTS
+#define MAX_SENSORS BM_PROTOCOL_MAX_SENSORS
+#define MAX_NAME_LENGTH 32
+
+// Structure to store the configuration of one backlight or LED output
 typedef struct {
+  char name[MAX_NAME_LENGTH];
+  char path[256];
+  char sensor[MAX_NAME_LENGTH];
+  bool manual;
+  double brightness_factor;
+  int min_brightness;
+  int max_brightness;
+  int deadband_abs;
+  int deadband_percent;
+  int transition_duration_ms;
+  int transition_fps;
+  int transition_curve;
+  int resume_transition_ms;
+  int external_change;
+  char display_connector[256];
+  CurveConfig curve;
+} OutputConfig;
+
+#define MAX_BURST_SAMPLES 16
+
+// Structure to store the configuration of one ambient light sensor
+typedef struct {
+  char name[MAX_NAME_LENGTH];
   char sensor_path[256];
   char sensor_file[256];
   char sensor_file_path[256];
+  bool explicit_path;
+  FilterConfig filter;
+  int capture;
+  int buffer_length;
+  int buffer_watermark;
+  char buffer_trigger[64];
+  char buffer_file[256];
+  int event_band_percent;
+  int event_band_min;
+  char event_file[256];
+  bool lux;
+  bool auto_range;
+  int range_raw_max;
+  int range_high_percent;
+  int range_low_percent;
+  bool match_sampling_frequency;
+  double gain;
+  int fusion;
+  char fusion_sensors[128];
+  int fusion_outlier_percent;
+  int fusion_weight;
+  int burst_samples;
+  int burst_trim_percent;
+} SensorConfig;
+
+// Structure to store configuration data
+// Keys before the first [output NAME] or [sensor NAME] section are defaults
+// for every section that follows. The legacy screen_backlight_path,
+// keyboard_backlight_path and sensor_file keys register an output named
+// screen, an output named keyboard and a sensor named default.
+typedef struct {
   char keyboard_backlight_path[256];
   char screen_backlight_path[256];
-  double brightness_factor;
   int update_rate;
-  int min_brightness;
+  int sample_interval_min_ms;
+  int sample_interval_max_ms;
+  int adapt_threshold;
+  int adapt_growth_percent;
+  int hotplug_backend;
+  char hotplug_directories[256];
+  char input_devices[256];
+  int input_step;
+  int input_step_max;
+  int input_repeat_growth_percent;
+  int reconcile_interval_ms;
+  int resume_burst_samples;
+  int display_probe_interval_ms;
+  OutputConfig output_defaults;
+  SensorConfig sensor_defaults;
+  OutputConfig outputs[MAX_OUTPUTS];
+  int output_count;
+  SensorConfig sensors[MAX_SENSORS];
+  int sensor_count;
 } ConfigData;
 
+// Backends of the hotplug monitor
+typedef enum {
+  HOTPLUG_NONE,
+  HOTPLUG_NETLINK,
+  HOTPLUG_INOTIFY
+} HotplugBackendType;
+
+// Function to parse the name of a hotplug backend
+int parse_hotplug_backend(const char* name) {
+  if (strcmp(name, "netlink") == 0) {
+    return HOTPLUG_NETLINK;
+  } else if (strcmp(name, "inotify") == 0) {
+    return HOTPLUG_INOTIFY;
+  } else if (strcmp(name, "none") != 0) {
+    fprintf(stderr, "Unknown hotplug backend: %s\n", name);
+  }
+  return HOTPLUG_NONE;
+}
+
+// Methods to read an ambient light sensor
+typedef enum {
+  CAPTURE_SYSFS,
+  CAPTURE_BUFFER,
+  CAPTURE_EVENTS
+} CaptureMode;
+
+// Function to parse the name of a sensor capture method
+int parse_capture_mode(const char* name) {
+  if (strcmp(name, "buffer") == 0) {
+    return CAPTURE_BUFFER;
+  } else if (strcmp(name, "events") == 0) {
+    return CAPTURE_EVENTS;
+  } else if (strcmp(name, "sysfs") != 0) {
+    fprintf(stderr, "Unknown capture method: %s\n", name);
+  }
+  return CAPTURE_SYSFS;
+}
+
+// Ways to combine the readings of several sensors
+typedef enum {
+  FUSION_NONE,
+  FUSION_MAX,
+  FUSION_MEAN,
+  FUSION_WEIGHTED
+} FusionMode;
+
+// Function to parse the name of a fusion mode
+int parse_fusion_mode(const char* name) {
+  if (strcmp(name, "max") == 0) {
+    return FUSION_MAX;
+  } else if (strcmp(name, "mean") == 0) {
+    return FUSION_MEAN;
+  } else if (strcmp(name, "weighted") == 0) {
+    return FUSION_WEIGHTED;
+  } else if (strcmp(name, "none") != 0) {
+    fprintf(stderr, "Unknown fusion mode: %s\n", name);
+  }
+  return FUSION_NONE;
+}
+
+// Function to parse a boolean config value
+bool parse_bool(const char* value) {
+  return strcmp(value, "true") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "1") == 0;
+}
+
+// Function to apply an output key, returns false for unknown keys
+bool parse_output_key(OutputConfig* output, const char* key, const char* value) {
+  if (strcmp(key, "path") == 0) {
+    strncpy(output->path, value, sizeof(output->path) - 1);
+  } else if (strcmp(key, "sensor") == 0) {
+    strncpy(output->sensor, (strcmp(value, "none") == 0) ? "" : value, sizeof(output->sensor) - 1);
+  } else if (strcmp(key, "manual") == 0) {
+    output->manual = parse_bool(value);
+  } else if (strcmp(key, "min_brightness") == 0) {
+    output->min_brightness = atoi(value);
+  } else if (strcmp(key, "max_brightness") == 0) {
+    output->max_brightness = atoi(value);
+  } else if (strcmp(key, "deadband_abs") == 0) {
+    output->deadband_abs = atoi(value);
+  } else if (strcmp(key, "deadband_percent") == 0) {
+    output->deadband_percent = atoi(value);
+  } else if (strcmp(key, "transition_duration_ms") == 0) {
+    output->transition_duration_ms = atoi(value);
+  } else if (strcmp(key, "transition_fps") == 0) {
+    output->transition_fps = atoi(value);
+  } else if (strcmp(key, "transition_curve") == 0) {
+    output->transition_curve = parse_easing_curve(value);
+  } else if (strcmp(key, "resume_transition_ms") == 0) {
+    output->resume_transition_ms = atoi(value);
+  } else if (strcmp(key, "curve_points") == 0) {
+    parse_curve_points(&output->curve, value);
+  } else if (strcmp(key, "curve_gamma") == 0) {
+    sscanf(value, "%lf", &output->curve.gamma);
+    output->curve.type = CURVE_GAMMA;
+  } else if (strcmp(key, "curve_max_lux") == 0) {
+    output->curve.max_input = atoi(value);
+  } else if (strcmp(key, "brightness_factor") == 0) {
+    sscanf(value, "%lf", &output->brightness_factor);
+  } else if (strcmp(key, "external_change") == 0) {
+    output->external_change = parse_external_change(value);
+  } else if (strcmp(key, "display_connector") == 0) {
+    strncpy(output->display_connector, value, sizeof(output->display_connector) - 1);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Function to apply a sensor key, returns false for unknown keys
+bool parse_sensor_key(SensorConfig* sensor, const char* key, const char* value) {
+  if (strcmp(key, "sensor_path") == 0) {
+    strncpy(sensor->sensor_path, value, sizeof(sensor->sensor_path) - 1);
+  } else if (strcmp(key, "sensor_file") == 0) {
+    strncpy(sensor->sensor_file, value, sizeof(sensor->sensor_file) - 1);
+  } else if (strcmp(key, "path") == 0) {
+    // Explicit IIO device directory, skips the device scan
+    strncpy(sensor->sensor_file_path, value, sizeof(sensor->sensor_file_path) - 1);
+    sensor->explicit_path = true;
+  } else if (strcmp(key, "filter_chain") == 0) {
+    parse_filter_chain(&sensor->filter, value);
+  } else if (strcmp(key, "filter_median_window") == 0) {
+    sensor->filter.median_window = atoi(value);
+  } else if (strcmp(key, "filter_ema_alpha_percent") == 0) {
+    sensor->filter.ema_alpha_percent = atoi(value);
+  } else if (strcmp(key, "filter_brighten_ms") == 0) {
+    sensor->filter.brighten_ms = atoi(value);
+  } else if (strcmp(key, "filter_dim_ms") == 0) {
+    sensor->filter.dim_ms = atoi(value);
+  } else if (strcmp(key, "filter_spike_percent") == 0) {
+    sensor->filter.spike_percent = atoi(value);
+  } else if (strcmp(key, "filter_spike_count") == 0) {
+    sensor->filter.spike_count = atoi(value);
+  } else if (strcmp(key, "capture") == 0) {
+    sensor->capture = parse_capture_mode(value);
+  } else if (strcmp(key, "buffer_length") == 0) {
+    sensor->buffer_length = atoi(value);
+  } else if (strcmp(key, "buffer_watermark") == 0) {
+    sensor->buffer_watermark = atoi(value);
+  } else if (strcmp(key, "buffer_trigger") == 0) {
+    strncpy(sensor->buffer_trigger, value, sizeof(sensor->buffer_trigger) - 1);
+  } else if (strcmp(key, "buffer_file") == 0) {
+    // Test mode, scans are read from a regular file instead of the device
+    strncpy(sensor->buffer_file, value, sizeof(sensor->buffer_file) - 1);
+  } else if (strcmp(key, "event_band_percent") == 0) {
+    sensor->event_band_percent = atoi(value);
+  } else if (strcmp(key, "event_band_min") == 0) {
+    sensor->event_band_min = atoi(value);
+  } else if (strcmp(key, "event_file") == 0) {
+    // Test mode, struct iio_event_data records are read from this file or pipe
+    strncpy(sensor->event_file, value, sizeof(sensor->event_file) - 1);
+  } else if (strcmp(key, "burst_samples") == 0) {
+    sensor->burst_samples = atoi(value);
+  } else if (strcmp(key, "burst_trim_percent") == 0) {
+    sensor->burst_trim_percent = atoi(value);
+  } else if (strcmp(key, "units") == 0) {
+    sensor->lux = (strcmp(value, "lux") == 0);
+  } else if (strcmp(key, "auto_range") == 0) {
+    sensor->auto_range = parse_bool(value);
+  } else if (strcmp(key, "range_raw_max") == 0) {
+    sensor->range_raw_max = atoi(value);
+  } else if (strcmp(key, "range_high_percent") == 0) {
+    sensor->range_high_percent = atoi(value);
+  } else if (strcmp(key, "range_low_percent") == 0) {
+    sensor->range_low_percent = atoi(value);
+  } else if (strcmp(key, "match_sampling_frequency") == 0) {
+    sensor->match_sampling_frequency = parse_bool(value);
+  } else if (strcmp(key, "gain") == 0) {
+    sensor->gain = atof(value);
+  } else if (strcmp(key, "fusion") == 0) {
+    sensor->fusion = parse_fusion_mode(value);
+  } else if (strcmp(key, "fusion_sensors") == 0) {
+    strncpy(sensor->fusion_sensors, value, sizeof(sensor->fusion_sensors) - 1);
+  } else if (strcmp(key, "fusion_outlier_percent") == 0) {
+    sensor->fusion_outlier_percent = atoi(value);
+  } else if (strcmp(key, "fusion_weight") == 0) {
+    sensor->fusion_weight = atoi(value);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Function to find a configured sensor by name
+int find_sensor_config(const ConfigData* config, const char* name) {
+  for (int i = 0; i < config->sensor_count; i++) {
+    if (strcmp(config->sensors[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Function to find a configured output by name
+int find_output_config(const ConfigData* config, const char* name) {
+  for (int i = 0; i < config->output_count; i++) {
+    if (strcmp(config->outputs[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Function to add an output initialized from the defaults
+OutputConfig* add_output_config(ConfigData* config, const char* name) {
+  if (config->output_count == MAX_OUTPUTS) {
+    fprintf(stderr, "Too many outputs, ignoring %s\n", name);
+    return NULL;
+  }
+  OutputConfig* output = &config->outputs[config->output_count++];
+  *output = config->output_defaults;
+  strncpy(output->name, name, sizeof(output->name) - 1);
+  return output;
+}
+
+// Function to add a sensor initialized from the defaults
+SensorConfig* add_sensor_config(ConfigData* config, const char* name) {
+  if (config->sensor_count == MAX_SENSORS) {
+    fprintf(stderr, "Too many sensors, ignoring %s\n", name);
+    return NULL;
+  }
+  SensorConfig* sensor = &config->sensors[config->sensor_count++];
+  *sensor = config->sensor_defaults;
+  strncpy(sensor->name, name, sizeof(sensor->name) - 1);
+  return sensor;
+}
+
 // Function to read configuration data from the config file
 ConfigData read_config_data() {
   ConfigData config;
+  memset(&config, 0, sizeof(config));
+  config.update_rate = 5;
+  config.adapt_threshold = 50;
+  config.adapt_growth_percent = 150;
+  config.hotplug_backend = HOTPLUG_NETLINK;
+  config.input_step = 5;
+  config.input_step_max = 20;
+  config.input_repeat_growth_percent = 125;
+  config.reconcile_interval_ms = 5000;
+  config.resume_burst_samples = 8;
+  config.display_probe_interval_ms = 2000;
+  OutputConfig* output_defaults = &config.output_defaults;
+  strcpy(output_defaults->sensor, "default");
+  output_defaults->manual = true;
+  output_defaults->max_brightness = 100;
+  output_defaults->deadband_percent = 1;
+  output_defaults->transition_duration_ms = 250;
+  output_defaults->transition_fps = 60;
+  output_defaults->transition_curve = EASING_EASE_IN_OUT;
+  output_defaults->resume_transition_ms = 50;
+  output_defaults->curve.type = CURVE_LINEAR;
+  output_defaults->curve.gamma = 2.2;
+  output_defaults->curve.max_input = 1000;
+  FilterConfig* filter_defaults = &config.sensor_defaults.filter;
+  filter_defaults->median_window = 5;
+  filter_defaults->ema_alpha_percent = 30;
+  filter_defaults->brighten_ms = 1000;
+  filter_defaults->dim_ms = 4000;
+  filter_defaults->spike_percent = 200;
+  filter_defaults->spike_count = 3;
+  config.sensor_defaults.capture = CAPTURE_SYSFS;
+  config.sensor_defaults.buffer_length = 64;
+  config.sensor_defaults.buffer_watermark = 8;
+  config.sensor_defaults.event_band_percent = 10;
+  config.sensor_defaults.event_band_min = 5;
+  config.sensor_defaults.range_raw_max = 65535;
+  config.sensor_defaults.range_high_percent = 90;
+  config.sensor_defaults.range_low_percent = 10;
+  config.sensor_defaults.gain = 1.0;
+  config.sensor_defaults.fusion = FUSION_NONE;
+  config.sensor_defaults.fusion_outlier_percent = 50;
+  config.sensor_defaults.fusion_weight = 1;
+  config.sensor_defaults.burst_samples = 1;
+  config.sensor_defaults.burst_trim_percent = 25;
+
+  OutputConfig* output = NULL;
+  SensorConfig* sensor = NULL;
+  bool in_section = false;
   FILE* fp = fopen(get_config_file_path(), "r");
   if (fp != NULL) {
     char line[256];
@@ -120,21 +634,60 @@ ConfigData read_config_data() {
       line[strcspn(line, "\n")] = '\0';
 
       char key[256], value[256];
-      if (sscanf(line, "%255[^=]=%255s", key, value) == 2) {
-        if (strcmp(key, "sensor_path") == 0) {
-          strncpy(config.sensor_path, value, sizeof(config.sensor_path));
-        } else if (strcmp(key, "sensor_file") == 0) {
-          strncpy(config.sensor_file, value, sizeof(config.sensor_file));
+      if (sscanf(line, "[output %31[^]]]", value) == 1) {
+        output = add_output_config(&config, value);
+        sensor = NULL;
+        in_section = true;
+      } else if (sscanf(line, "[sensor %31[^]]]", value) == 1) {
+        sensor = add_sensor_config(&config, value);
+        output = NULL;
+        in_section = true;
+      } else if (sscanf(line, "%255[^=]=%255s", key, value) == 2) {
+        if (key[0] == '#') {
+          continue;
+        } else if (output != NULL || sensor != NULL) {
+          if (!((output != NULL && parse_output_key(output, key, value)) ||
+                (sensor != NULL && parse_sensor_key(sensor, key, value)))) {
+            fprintf(stderr, "Unknown key in section: %s\n", key);
+          }
+        } else if (in_section) {
+          // Section that could not be added
+          continue;
         } else if (strcmp(key, "keyboard_backlight_path") == 0) {
-          strncpy(config.keyboard_backlight_path, value, sizeof(config.keyboard_backlight_path));
+          strncpy(config.keyboard_backlight_path, value, sizeof(config.keyboard_backlight_path) - 1);
         } else if (strcmp(key, "screen_backlight_path") == 0) {
-          strncpy(config.screen_backlight_path, value, sizeof(config.screen_backlight_path));
+          strncpy(config.screen_backlight_path, value, sizeof(config.screen_backlight_path) - 1);
         } else if (strcmp(key, "update_rate") == 0) {
           config.update_rate = atoi(value);
-        } else if (strcmp(key, "min_brightness") == 0) {
-            config.min_brightness = atoi(value);
-        } else if (strcmp(key, "brightness_factor") == 0) {
-          sscanf(value, "%lf", &config.brightness_factor);
+        } else if (strcmp(key, "sample_interval_min_ms") == 0) {
+          config.sample_interval_min_ms = atoi(value);
+        } else if (strcmp(key, "sample_interval_max_ms") == 0) {
+          config.sample_interval_max_ms = atoi(value);
+        } else if (strcmp(key, "adapt_threshold") == 0) {
+          config.adapt_threshold = atoi(value);
+        } else if (strcmp(key, "adapt_growth_percent") == 0) {
+          config.adapt_growth_percent = atoi(value);
+        } else if (strcmp(key, "hotplug_backend") == 0) {
+          config.hotplug_backend = parse_hotplug_backend(value);
+        } else if (strcmp(key, "hotplug_directories") == 0) {
+          strncpy(config.hotplug_directories, value, sizeof(config.hotplug_directories) - 1);
+        } else if (strcmp(key, "input_devices") == 0) {
+          strncpy(config.input_devices, value, sizeof(config.input_devices) - 1);
+        } else if (strcmp(key, "input_step") == 0) {
+          config.input_step = atoi(value);
+        } else if (strcmp(key, "input_step_max") == 0) {
+          config.input_step_max = atoi(value);
+        } else if (strcmp(key, "input_repeat_growth_percent") == 0) {
+          config.input_repeat_growth_percent = atoi(value);
+        } else if (strcmp(key, "reconcile_interval_ms") == 0) {
+          config.reconcile_interval_ms = atoi(value);
+        } else if (strcmp(key, "resume_burst_samples") == 0) {
+          config.resume_burst_samples = atoi(value);
+        } else if (strcmp(key, "display_probe_interval_ms") == 0) {
+          config.display_probe_interval_ms = atoi(value);
+        } else if (!parse_output_key(&config.output_defaults, key, value) &&
+                   !parse_sensor_key(&config.sensor_defaults, key, value)) {
+          fprintf(stderr, "Unknown key: %s\n", key);
         }
       }
     }
@@ -142,49 +695,340 @@ ConfigData read_config_data() {
   } else {
     perror("could not open config file");
   }
-  char* sensor_file_path = get_sensor_path(config.sensor_path, config.sensor_file);
-  if (sensor_file_path == NULL) {
-    perror("Sensor file not found");
-    exit(EXIT_FAILURE);
+
+  // Register the devices of the legacy single output configuration
+  if (config.sensor_defaults.sensor_file[0] != '\0' && find_sensor_config(&config, "default") == -1) {
+    add_sensor_config(&config, "default");
+  }
+  if (config.screen_backlight_path[0] != '\0' && find_output_config(&config, "screen") == -1) {
+    output = add_output_config(&config, "screen");
+    if (output != NULL) {
+      strncpy(output->path, config.screen_backlight_path, sizeof(output->path) - 1);
+    }
+  }
+  if (config.keyboard_backlight_path[0] != '\0' && find_output_config(&config, "keyboard") == -1) {
+    // The keyboard backlight neither follows the sensor nor takes -s adjustments
+    output = add_output_config(&config, "keyboard");
+    if (output != NULL) {
+      strncpy(output->path, config.keyboard_backlight_path, sizeof(output->path) - 1);
+      output->sensor[0] = '\0';
+      output->manual = false;
+    }
   }
-  strncpy(config.sensor_file_path, sensor_file_path, sizeof(config.sensor_file_path));
-  free(sensor_file_path);
+
+  // Without explicit bounds the slowest sampling interval is the legacy update_rate
+  if (config.sample_interval_max_ms <= 0) {
+    config.sample_interval_max_ms = ((config.update_rate > 0) ? config.update_rate : 1) * 1000;
+  }
+  if (config.sample_interval_min_ms <= 0 || config.sample_interval_min_ms > config.sample_interval_max_ms) {
+    config.sample_interval_min_ms = (config.sample_interval_max_ms < 250) ? config.sample_interval_max_ms : 250;
+  }
+  if (config.adapt_growth_percent < 100) {
+    config.adapt_growth_percent = 100;
+  }
+  if (config.input_step < 1) {
+    config.input_step = 1;
+  }
+  if (config.input_step_max < config.input_step) {
+    config.input_step_max = config.input_step;
+  }
+  if (config.input_repeat_growth_percent < 100) {
+    config.input_repeat_growth_percent = 100;
+  }
+  for (int i = 0; i < config.output_count; i++) {
+    output = &config.outputs[i];
+    if (output->sensor[0] != '\0' && find_sensor_config(&config, output->sensor) == -1) {
+      fprintf(stderr, "Output %s refers to unknown sensor %s\n", output->name, output->sensor);
+      output->sensor[0] = '\0';
+    }
+    if (output->max_brightness <= 0 || output->max_brightness > 100) {
+      output->max_brightness = 100;
+    }
+    // The curve divides by both, a bad value would put NaN or inf in the table
+    if (!(output->curve.gamma > 0.0)) {
+      fprintf(stderr, "Invalid curve gamma of output %s\n", output->name);
+      output->curve.gamma = 2.2;
+    }
+    if (output->curve.max_input < 1) {
+      fprintf(stderr, "Invalid curve max lux of output %s\n", output->name);
+      output->curve.max_input = 1000;
+    }
+  }
+  for (int i = 0; i < config.sensor_count; i++) {
+    sensor = &config.sensors[i];
+    if (sensor->range_low_percent < 0 || sensor->range_high_percent > 100 ||
+        sensor->range_low_percent * 2 >= sensor->range_high_percent) {
+      // The band must leave room for a switch not to bounce straight back
+      fprintf(stderr, "Invalid auto ranging thresholds of sensor %s\n", sensor->name);
+      sensor->range_low_percent = 10;
+      sensor->range_high_percent = 90;
+    }
+    if (sensor->buffer_length < 1) {
+      sensor->buffer_length = 1;
+    }
+    if (sensor->burst_samples < 1) {
+      sensor->burst_samples = 1;
+    } else if (sensor->burst_samples > MAX_BURST_SAMPLES) {
+      sensor->burst_samples = MAX_BURST_SAMPLES;
+    }
+    if (sensor->burst_trim_percent < 0 || sensor->burst_trim_percent >= 50) {
+      fprintf(stderr, "Invalid burst trim of sensor %s\n", sensor->name);
+      sensor->burst_trim_percent = 25;
+    }
+    if (sensor->buffer_watermark < 1 || sensor->buffer_watermark > sensor->buffer_length) {
+      sensor->buffer_watermark = sensor->buffer_length;
+    }
+    if (sensor->filter.median_window < 1) {
+      sensor->filter.median_window = 1;
+    } else if (sensor->filter.median_window > MAX_MEDIAN_WINDOW) {
+      sensor->filter.median_window = MAX_MEDIAN_WINDOW;
+    }
+  }
+  // Sensors are looked up in sensor_path only when they are opened, so
+  // client commands never scan the IIO devices
   return config;
 }
 
-// Function to read a file
-int read_file(const char* file_path, const char* filename) {
-  char path[512];
-  snprintf(path, sizeof(path), "%s/%s", file_path, filename);
-  FILE* fp = fopen(path, "r");
-  if (fp == NULL) {
-    printf("%s\n", path);
-    perror("Error reading file");
-    exit(EXIT_FAILURE);
+// Structure holding a sysfs attribute that stays open for the daemon lifetime
+typedef struct {
+  char path[MAX_PATH_LENGTH];
+  int flags;
+  int fd;
+} SysfsAttribute;
+
+// Structure holding the open attributes of a backlight device
+// The last written value is cached, so unchanged targets never reach sysfs
+// and adjustments never read it back. Changes by other programs are found by
+// comparing the cache with the brightness attribute.
+typedef struct {
+  SysfsAttribute actual_brightness;
+  SysfsAttribute brightness;
+  SysfsAttribute hw_changed;
+  bool led;
+  int min_brightness;
+  int max_brightness;
+  int current_brightness;
+  unsigned long writes;
+  unsigned long suppressed_writes;
+  unsigned long external_changes;
+} Backlight;
+
+// Function to parse a decimal integer without going through stdio
+// Leading whitespace is skipped and parsing stops at the first non digit
+int parse_int(const char* buffer, size_t length, int* value) {
+  size_t i = 0;
+  while (i < length && (buffer[i] == ' ' || buffer[i] == '\t')) {
+    i++;
+  }
+  bool negative = false;
+  if (i < length && (buffer[i] == '-' || buffer[i] == '+')) {
+    negative = buffer[i] == '-';
+    i++;
+  }
+  size_t first_digit = i;
+  long result = 0;
+  while (i < length && buffer[i] >= '0' && buffer[i] <= '9') {
+    result = result * 10 + (buffer[i] - '0');
+    if (result > 2147483647L) {
+      return -1;
+    }
+    i++;
+  }
+  if (i == first_digit) {
+    return -1;
+  }
+  *value = (int)(negative ? -result : result);
+  return 0;
+}
+
+// Function to format an integer followed by a newline into a buffer
+// Returns the number of characters written, the buffer needs 13 bytes
+size_t format_int(char* buffer, int value) {
+  char digits[12];
+  size_t count = 0;
+  unsigned int magnitude = (value < 0) ? 0u - (unsigned int)value : (unsigned int)value;
+  do {
+    digits[count++] = (char)('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude > 0);
+  size_t length = 0;
+  if (value < 0) {
+    buffer[length++] = '-';
+  }
+  while (count > 0) {
+    buffer[length++] = digits[--count];
+  }
+  buffer[length++] = '\n';
+  return length;
+}
+
+// Function to open a sysfs attribute once and keep the descriptor
+int attribute_open(SysfsAttribute* attribute, const char* directory, const char* filename, int flags) {
+  snprintf(attribute->path, sizeof(attribute->path), "%s/%s", directory, filename);
+  attribute->flags = flags;
+  attribute->fd = open(attribute->path, flags | O_CLOEXEC);
+  return (attribute->fd == -1) ? -1 : 0;
+}
+
+// Function to close a sysfs attribute
+void attribute_close(SysfsAttribute* attribute) {
+  if (attribute->fd != -1) {
+    close(attribute->fd);
+    attribute->fd = -1;
+  }
+}
+
+// Function to reopen an attribute whose device went away underneath us
+int attribute_reopen(SysfsAttribute* attribute) {
+  attribute_close(attribute);
+  attribute->fd = open(attribute->path, attribute->flags | O_CLOEXEC);
+  return (attribute->fd == -1) ? -1 : 0;
+}
+
+// Check if an errno value means the descriptor points to a removed device
+bool attribute_is_stale(int error) {
+  return error == ENODEV || error == ESTALE || error == EBADF;
+}
+
+// Function to read an integer attribute with a single pread
+int attribute_read_int(SysfsAttribute* attribute, int* value) {
+  char buffer[32];
+  ssize_t bytes_read = pread(attribute->fd, buffer, sizeof(buffer), 0);
+  if (bytes_read == -1 && attribute_is_stale(errno) && attribute_reopen(attribute) == 0) {
+    bytes_read = pread(attribute->fd, buffer, sizeof(buffer), 0);
+  }
+  if (bytes_read <= 0) {
+    return -1;
+  }
+  return parse_int(buffer, (size_t)bytes_read, value);
+}
+
+// Function to read a string attribute with a single pread, without the newline
+int attribute_read_string(SysfsAttribute* attribute, char* buffer, size_t size) {
+  ssize_t bytes_read = pread(attribute->fd, buffer, size - 1, 0);
+  if (bytes_read == -1 && attribute_is_stale(errno) && attribute_reopen(attribute) == 0) {
+    bytes_read = pread(attribute->fd, buffer, size - 1, 0);
+  }
+  if (bytes_read <= 0) {
+    return -1;
+  }
+  buffer[bytes_read] = '\0';
+  buffer[strcspn(buffer, "\n")] = '\0';
+  return 0;
+}
+
+// Function to write an integer attribute with a single pwrite
+int attribute_write_int(SysfsAttribute* attribute, int value) {
+  char buffer[16];
+  size_t length = format_int(buffer, value);
+  ssize_t bytes_written = pwrite(attribute->fd, buffer, length, 0);
+  if (bytes_written == -1 && attribute_is_stale(errno) && attribute_reopen(attribute) == 0) {
+    bytes_written = pwrite(attribute->fd, buffer, length, 0);
+  }
+  return (bytes_written == (ssize_t)length) ? 0 : -1;
+}
+
+// Function to read the brightness last requested from the device
+// This is the value any program wrote, actual_brightness is only used if the
+// brightness file cannot be read
+int read_requested_brightness(Backlight* backlight, int* value) {
+  if (backlight->brightness.flags == O_RDWR) {
+    return attribute_read_int(&backlight->brightness, value);
+  }
+  return attribute_read_int(&backlight->actual_brightness, value);
+}
+
+// Function to open the brightness attributes of a backlight device
+// LED class devices have no actual_brightness, their brightness file is read instead
+int open_backlight(Backlight* backlight, const char* backlight_path) {
+  SysfsAttribute max_brightness;
+  backlight->actual_brightness.fd = -1;
+  backlight->brightness.fd = -1;
+  backlight->hw_changed.fd = -1;
+  if (attribute_open(&max_brightness, backlight_path, "max_brightness", O_RDONLY) == -1) {
+    fprintf(stderr, "Backlight device not available: %s\n", backlight_path);
+    return -1;
+  }
+  int result = attribute_read_int(&max_brightness, &backlight->max_brightness);
+  attribute_close(&max_brightness);
+  if (result == -1 || backlight->max_brightness <= 0) {
+    fprintf(stderr, "Invalid max_brightness: %s\n", backlight_path);
+    return -1;
+  }
+  // A backlight is never turned fully off, a LED may be
+  backlight->min_brightness = 1;
+  backlight->led = false;
+  if (attribute_open(&backlight->actual_brightness, backlight_path, "actual_brightness", O_RDONLY) == -1) {
+    backlight->min_brightness = 0;
+    backlight->led = true;
+    if (attribute_open(&backlight->actual_brightness, backlight_path, "brightness", O_RDONLY) == -1) {
+      perror("Error opening actual_brightness");
+      return -1;
+    }
+  }
+  // The brightness file is read back to find writes by other programs
+  if (attribute_open(&backlight->brightness, backlight_path, "brightness", O_RDWR) == -1 &&
+      attribute_open(&backlight->brightness, backlight_path, "brightness", O_WRONLY) == -1) {
+    perror("Error opening brightness");
+    attribute_close(&backlight->actual_brightness);
+    return -1;
   }
+  // Only LEDs changed by the firmware, e.g. by a hotkey, have this attribute
+  attribute_open(&backlight->hw_changed, backlight_path, "brightness_hw_changed", O_RDONLY);
+  if (read_requested_brightness(backlight, &backlight->current_brightness) == -1) {
+    backlight->current_brightness = -1;
+  }
+  backlight->writes = 0;
+  backlight->suppressed_writes = 0;
+  backlight->external_changes = 0;
+  return 0;
+}
+
+// Function to close the brightness attributes of a backlight device
+void close_backlight(Backlight* backlight) {
+  attribute_close(&backlight->actual_brightness);
+  attribute_close(&backlight->brightness);
+  attribute_close(&backlight->hw_changed);
+}
 
-  int brightness;
-  fscanf(fp, "%d", &brightness);
-  fclose(fp);
+// Function to clamp a brightness value to the range of the backlight
+int clamp_brightness(const Backlight* backlight, int brightness) {
+  if (brightness < backlight->min_brightness) {
+    return backlight->min_brightness;
+  } else if (brightness > backlight->max_brightness) {
+    return backlight->max_brightness;
+  }
   return brightness;
 }
 
 // Function to set the backlight brightness
-void set_backlight_brightness(const char* backlight_path, int brightness, int max_brightness) {
-  if (brightness < 1) {
-    brightness = 1;
-  } else if (brightness > max_brightness) {
-    brightness = max_brightness;
-  }
-  char path[512];
-  snprintf(path, sizeof(path), "%s/brightness", backlight_path);
-  FILE* fp = fopen(path, "w");
-  if (fp == NULL) {
+void set_backlight_brightness(Backlight* backlight, int brightness) {
+  brightness = clamp_brightness(backlight, brightness);
+  if (brightness == backlight->current_brightness) {
+    backlight->suppressed_writes++;
+    return;
+  }
+  if (attribute_write_int(&backlight->brightness, brightness) == -1) {
     perror("Error write to brightness file");
-    exit(EXIT_FAILURE);
+    return;
+  }
+  backlight->current_brightness = brightness;
+  backlight->writes++;
+}
+
+// Check if a new target is within the deadband around a reference value
+// Small target changes caused by sensor jitter are counted as suppressed writes
+bool within_deadband(Backlight* backlight, int reference, int brightness, int deadband_abs, int deadband_percent) {
+  int deadband = backlight->max_brightness * deadband_percent / 100;
+  if (deadband_abs > deadband) {
+    deadband = deadband_abs;
+  }
+  int difference = brightness - reference;
+  if (reference >= 0 && difference <= deadband && difference >= -deadband) {
+    backlight->suppressed_writes++;
+    return true;
   }
-  fprintf(fp, "%d", brightness);
-  fclose(fp);
+  return false;
 }
 
 // Function to display usage information
@@ -194,25 +1038,100 @@ void display_usage() {
   printf("  -h, --help             Display this help and exit\n");
   printf("  -a, --ambient          Enable ambient mode\n");
   printf("  -p, --print-status     Print the actual status of the daemon\n");
+  printf("  -w, --watch            Print the daemon state on every change\n");
+  printf("  -i, --input            Feed brightness changes from stdin to the daemon\n");
   printf("  -s, --set <value>      Set change of brightness\n");
+  printf("  -b, --brightness <n>   Set the brightness in percent\n");
 }
 
 // Function to print the actual config values
 void print_info(const ConfigData* config) {
   printf("Backlight Manager Config:\n");
-  printf("  Sensor Path: %s\n", config->sensor_path);
-  printf("  Sensor File: %s\n", config->sensor_file);
-  printf("  Sensor File Path: %s\n", config->sensor_file_path);
-  printf("  Keyboard Backlight Path: %s\n", config->keyboard_backlight_path);
-  printf("  Screen Backlight Path: %s\n", config->screen_backlight_path);
   printf("  Update Rate: %d\n", config->update_rate);
-  printf("  Brightness Factor: %f\n", config->brightness_factor);
+  printf("  Sample Interval: %d - %d ms\n", config->sample_interval_min_ms, config->sample_interval_max_ms);
+  printf("  Reconcile Interval: %d ms\n", config->reconcile_interval_ms);
+  printf("  Resume Burst: %d samples\n", config->resume_burst_samples);
+  printf("  Display Probe Interval: %d ms\n", config->display_probe_interval_ms);
+  if (config->input_devices[0] != '\0') {
+    printf("  Input Devices: %s\n", config->input_devices);
+    printf("  Input Step: %d%% - %d%% (%d%% per repeat)\n", config->input_step, config->input_step_max,
+           config->input_repeat_growth_percent);
+  }
+  for (int i = 0; i < config->sensor_count; i++) {
+    const SensorConfig* sensor = &config->sensors[i];
+    printf("  Sensor %s:\n", sensor->name);
+    printf("    Sensor Path: %s\n", sensor->sensor_path);
+    printf("    Sensor File: %s\n", sensor->sensor_file);
+    // Only the config is printed, the IIO devices are not scanned for a client command
+    if (sensor->explicit_path) {
+      printf("    Sensor File Path: %s\n", sensor->sensor_file_path);
+    } else if (sensor->fusion == FUSION_NONE) {
+      printf("    Sensor File Path: first device in sensor path\n");
+    }
+    printf("    Filter Stages: %d\n", sensor->filter.stage_count);
+    if (sensor->capture == CAPTURE_BUFFER) {
+      printf("    Capture: buffer of %d scans, watermark %d%s%s\n", sensor->buffer_length, sensor->buffer_watermark,
+             (sensor->buffer_file[0] != '\0') ? ", from " : "", sensor->buffer_file);
+    }
+    if (sensor->fusion != FUSION_NONE && !sensor->explicit_path) {
+      static const char* fusion_names[] = { "none", "max", "mean", "weighted" };
+      printf("    Fusion: %s of %s, outliers beyond %d%%\n", fusion_names[sensor->fusion],
+             (sensor->fusion_sensors[0] != '\0') ? sensor->fusion_sensors : "every device", sensor->fusion_outlier_percent);
+    } else if (sensor->gain != 1.0) {
+      printf("    Gain: %f\n", sensor->gain);
+    }
+    if (sensor->burst_samples > 1) {
+      printf("    Burst: %d samples, trimmed by %d%%\n", sensor->burst_samples, sensor->burst_trim_percent);
+    }
+    printf("    Units: %s%s%s\n", sensor->lux ? "lux" : "raw", sensor->auto_range ? ", auto ranging" : "",
+           sensor->match_sampling_frequency ? ", matched sampling frequency" : "");
+    if (sensor->capture == CAPTURE_EVENTS) {
+      printf("    Capture: threshold events, band %d%% (at least %d)%s%s\n", sensor->event_band_percent,
+             sensor->event_band_min, (sensor->event_file[0] != '\0') ? ", from " : "", sensor->event_file);
+    }
+  }
+  for (int i = 0; i < config->output_count; i++) {
+    const OutputConfig* output = &config->outputs[i];
+    printf("  Output %s:\n", output->name);
+    printf("    Path: %s\n", output->path);
+    printf("    Sensor: %s\n", (output->sensor[0] != '\0') ? output->sensor : "none");
+    printf("    Manual Adjustments: %s\n", output->manual ? "yes" : "no");
+    printf("    Brightness Range: %d%% - %d%%\n", output->min_brightness, output->max_brightness);
+    printf("    Brightness Factor: %f\n", output->brightness_factor);
+    if (output->curve.type == CURVE_POINTS) {
+      printf("    Curve: %d points\n", output->curve.point_count);
+    } else if (output->curve.type == CURVE_GAMMA) {
+      printf("    Curve: gamma %.2f up to %d lux\n", output->curve.gamma, output->curve.max_input);
+    }
+    printf("    Deadband: %d (%d%%)\n", output->deadband_abs, output->deadband_percent);
+    printf("    Transition: %d ms at %d fps, %d ms after resume\n", output->transition_duration_ms, output->transition_fps,
+           output->resume_transition_ms);
+    static const char* external_change_names[] = { "rebase", "pause", "override" };
+    printf("    External Changes: %s\n", external_change_names[output->external_change]);
+    if (output->display_connector[0] != '\0') {
+      printf("    Display Connector: %s\n", output->display_connector);
+    }
+  }
+}
+
+// Function to compute the brightness after an adjustment in percent
+// The cached brightness is used, sysfs is only read while it is unknown.
+// Returns -1 if the current brightness could not be read
+int adjusted_brightness(int value, Backlight* backlight) {
+  int current_screen_brightness = backlight->current_brightness;
+  if (current_screen_brightness < 0 && attribute_read_int(&backlight->actual_brightness, &current_screen_brightness) == -1) {
+    perror("Error reading actual_brightness");
+    return -1;
+  }
+  return clamp_brightness(backlight, current_screen_brightness + (int)((backlight->max_brightness / 100.0) * value));
 }
 
 // Adjust brightness in percent
-void adjust_brightness(int value, int max_screen_brightness, const ConfigData* config) {
-    int current_screen_brightness = read_file(config->screen_backlight_path, "actual_brightness");
-    set_backlight_brightness(config->screen_backlight_path, current_screen_brightness + (int)((max_screen_brightness / 100.0) * value), max_screen_brightness);
+void adjust_brightness(int value, Backlight* backlight) {
+  int brightness = adjusted_brightness(value, backlight);
+  if (brightness != -1) {
+    set_backlight_brightness(backlight, brightness);
+  }
 }
 
 // Start backlight_manager as daemon
@@ -249,10 +1168,6 @@ void start_daemon() {
   open("/dev/null", O_WRONLY); // STDOUT_FILENO
   open("/dev/null", O_RDWR);   // STDERR_FILENO
 
-  // Set up signal handlers to handle termination signals
-  signal(SIGTERM, signal_handler);
-  signal(SIGINT, signal_handler);
-
   // Create the PID file and write the PID to it
   FILE* pid_file = fopen(PID_FILE_PATH, "w");
   if (pid_file == NULL) {
@@ -265,8 +1180,9 @@ void start_daemon() {
 }
 
 int open_pipe() {
-    // Open the named pipe in read-only mode
-    int fd = open(FIFO_PATH, O_RDONLY | O_NONBLOCK);
+    // Open the named pipe in read-write mode, so the daemon always holds a
+    // writer itself and epoll does not report EPOLLHUP once a client closes it
+    int fd = open(FIFO_PATH, O_RDWR | O_NONBLOCK);
 
     if (fd == -1) {
         perror("Error opening the named pipe");
@@ -312,6 +1228,19 @@ void stop_daemon() {
     }
 }
 
+// Function to ask a running daemon to log its statistics
+void request_statistics() {
+  FILE* pid_file = fopen(PID_FILE_PATH, "r");
+  if (pid_file == NULL) {
+    return;
+  }
+  pid_t pid;
+  if (fscanf(pid_file, "%d", &pid) == 1 && kill(pid, SIGUSR1) == 0) {
+    printf("Daemon statistics written to the system log\n");
+  }
+  fclose(pid_file);
+}
+
 void write_fifo(int value, bool ambient) {
     // Open the named pipe in write-only mode
     int fd = open(FIFO_PATH, O_WRONLY);
@@ -320,85 +1249,3606 @@ void write_fifo(int value, bool ambient) {
         perror("Error opening the named pipe");
         exit(EXIT_FAILURE);
     }
-    PipeData data;
+    BmPipeData data;
     data.brightness_adjustment = value;
     data.ambient_mode = ambient;
 
-    // Send the int8 value (example: 42)
-    ssize_t bytes_written = write(fd, &data, sizeof(data));
+    // Messages are smaller than PIPE_BUF, so each write is atomic
+    if (write(fd, &data, sizeof(data)) != sizeof(data)) {
+        perror("Error writing to the named pipe");
+    }
 
     // Close the pipe and exit
     close(fd);
 }
 
-PipeData* read_fifo(int fd) {
-    PipeData* value = (PipeData*) malloc(sizeof(PipeData));
+// Function to drain every pending message of the control pipe
+// The messages are coalesced into one command: adjustments are summed and
+// ambient toggles cancel out in pairs. Returns false if nothing was read.
+bool read_fifo(int fd, BmPipeData* command) {
+    BmPipeData messages[MAX_PIPE_MESSAGES];
+    int toggles = 0;
+    bool received = false;
+    command->brightness_adjustment = 0;
+    command->ambient_mode = false;
 
-    if (value == NULL) {
-        perror("Error allocating memory for PipeData");
-        return NULL;
+    for (;;) {
+        ssize_t bytes_read = read(fd, messages, sizeof(messages));
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                perror("Error reading from the named pipe");
+            }
+            break;
+        } else if (bytes_read == 0) {
+            // No data was read (end of file or pipe)
+            break;
+        }
+        size_t count = (size_t)bytes_read / sizeof(BmPipeData);
+        for (size_t i = 0; i < count; i++) {
+            command->brightness_adjustment += messages[i].brightness_adjustment;
+            toggles += messages[i].ambient_mode ? 1 : 0;
+        }
+        received = true;
+        if ((size_t)bytes_read < sizeof(messages)) {
+            break;
+        }
     }
 
-    ssize_t bytes_read = read(fd, value, sizeof(PipeData));
+    command->ambient_mode = (toggles % 2) == 1;
+    return received;
+}
 
-    if (bytes_read < 0) {
-        perror("Error reading from the named pipe");
-        free(value);
-        return NULL;
-    } else if (bytes_read == 0) {
-        // No data was read (end of file or pipe)
-        free(value);
-        return NULL;
-    }
+// Function to register a readiness source with the event loop
+int add_event_source(int epoll_fd, EventSource* source, uint32_t events) {
+  struct epoll_event event;
+  event.events = events;
+  event.data.ptr = source;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source->fd, &event) == -1) {
+    perror("Error adding file descriptor to epoll");
+    return -1;
+  }
+  return 0;
+}
 
-    return value;
+// Structure holding a running brightness transition of one backlight
+// Frames are scheduled on absolute deadlines of a timerfd, so they do not drift
+typedef struct {
+  EventSource timer;
+  Backlight* backlight;
+  const OutputConfig* config;
+  bool active;
+  bool fast;
+  int start_value;
+  int target_value;
+  long frame_interval_ns;
+  long frame_count;
+  long frame;
+} Transition;
+
+// Function to evaluate an easing curve in 16.16 fixed point
+long ease(int curve, long progress) {
+  long inverse;
+  switch (curve) {
+    case EASING_EASE_IN:
+      return (progress * progress) >> 16;
+    case EASING_EASE_OUT:
+      inverse = 65536 - progress;
+      return 65536 - ((inverse * inverse) >> 16);
+    case EASING_EASE_IN_OUT:
+      // Smoothstep: 3p^2 - 2p^3
+      return (((progress * progress) >> 16) * (3 * 65536 - 2 * progress)) >> 16;
+    default:
+      return progress;
+  }
 }
 
-int main(int argc, char* argv[]) {
-  bool ambient_mode = false; // Default value: ambient mode disabled
-  int brightness_adjustment = 0; // Default value: no brightness adjustment
-  bool daemon_mode = false; // Default value: dont run as daemon
-  bool print_status = false; // Default value: do not print status
-  ConfigData config = read_config_data();
-  int fd = 0;
-  // Parse command-line options using getopt
+// Function to stop a transition and disarm its timer
+void transition_stop(Transition* transition) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  timerfd_settime(transition->timer.fd, 0, &spec, NULL);
+  transition->active = false;
+}
 
-  int option;
-  const char* short_options = "hpdkas:";
-  static struct option long_options[] = {
-    {"help", no_argument, NULL, 'h'},
-    {"ambient", no_argument, NULL, 'a'},
-    {"daemon", no_argument, NULL, 'd'},
-    {"kill", no_argument, NULL, 'k'},
-    {"print-status", no_argument, NULL, 'p'},
-    {"set", required_argument, NULL, 's'},
-    {NULL, 0, NULL, 0}
-  };
+// Function to get the value a transition is heading to, or the current brightness
+int transition_target(const Transition* transition) {
+  return transition->active ? transition->target_value : transition->backlight->current_brightness;
+}
 
-  FILE* pid_file = fopen(PID_FILE_PATH, "r");
+// Function to animate the backlight towards a new target
+// A new target during a running fade restarts the fade from the current value.
+// A fast transition uses resume_transition_ms instead of the normal duration.
+void transition_start(Transition* transition, int target) {
+  Backlight* backlight = transition->backlight;
+  const OutputConfig* config = transition->config;
+  target = clamp_brightness(backlight, target);
+  if (transition->active && transition->target_value == target) {
+    return;
+  }
+  int start = backlight->current_brightness;
+  int distance = (target > start) ? target - start : start - target;
+  int duration_ms = transition->fast ? config->resume_transition_ms : config->transition_duration_ms;
+  if (start < 0 || duration_ms <= 0 || config->transition_fps <= 0 || distance <= 1) {
+    transition_stop(transition);
+    set_backlight_brightness(backlight, target);
+    return;
+  }
 
-  while ((option = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
-    switch (option) {
-      case 'h':
-        display_usage();
-        return 0;
-      case 'a':
-        ambient_mode = true;
-        break;
-      case 'd':
-          if (pid_file == NULL) {
-              start_daemon();
-          }
-        daemon_mode = true;
-        break;
-      case 'k':
-        stop_daemon();
-        exit(EXIT_SUCCESS);
-      case 'p':
-        print_status = true;
-        break;
-      case 's':
-        brightness_adjustment = atoi(optarg);
+  // Never schedule more frames than there are distinct brightness steps
+  long duration_ns = duration_ms * 1000000L;
+  long frame_interval_ns = 1000000000L / config->transition_fps;
+  if (duration_ns / distance > frame_interval_ns) {
+    frame_interval_ns = duration_ns / distance;
+  }
+  transition->start_value = start;
+  transition->target_value = target;
+  transition->frame_interval_ns = frame_interval_ns;
+  transition->frame_count = (duration_ns + frame_interval_ns - 1) / frame_interval_ns;
+  transition->frame = 0;
+  transition->active = true;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long first_frame_ns = now.tv_nsec + frame_interval_ns;
+  struct itimerspec spec;
+  spec.it_value.tv_sec = now.tv_sec + first_frame_ns / 1000000000L;
+  spec.it_value.tv_nsec = first_frame_ns % 1000000000L;
+  spec.it_interval.tv_sec = frame_interval_ns / 1000000000L;
+  spec.it_interval.tv_nsec = frame_interval_ns % 1000000000L;
+  if (timerfd_settime(transition->timer.fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+    perror("Error arming the transition timer");
+    transition->active = false;
+    set_backlight_brightness(backlight, target);
+  }
+}
+
+// Handler for frames of a brightness transition
+void handle_transition_timer(void* data, uint32_t events) {
+  Transition* transition = data;
+  (void)events;
+  uint64_t expirations;
+  if (read(transition->timer.fd, &expirations, sizeof(expirations)) != sizeof(expirations) || !transition->active) {
+    return;
+  }
+  // Missed frames are skipped instead of replayed
+  transition->frame += (long)expirations;
+  if (transition->frame >= transition->frame_count) {
+    transition_stop(transition);
+    set_backlight_brightness(transition->backlight, transition->target_value);
+    return;
+  }
+  long progress = (transition->frame << 16) / transition->frame_count;
+  long eased = ease(transition->config->transition_curve, progress);
+  int value = transition->start_value + (int)(((long)(transition->target_value - transition->start_value) * eased) >> 16);
+  // Only frames that change the quantized value reach sysfs
+  if (value != transition->backlight->current_brightness) {
+    set_backlight_brightness(transition->backlight, value);
+  }
+}
+
+// Structure holding the state of the adaptive ambient sampler
+// The interval drops to the minimum when the light changes quickly and grows
+// exponentially back towards the maximum while readings are stable
+typedef struct {
+  int interval_ms;
+  int last_value;
+  long last_sample_ms;
+  bool has_sample;
+} AdaptiveSampler;
+
+// Function to get the monotonic clock in milliseconds
+long monotonic_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+// Function to reset the sampler to its fastest rate
+void sampler_reset(AdaptiveSampler* sampler, const ConfigData* config) {
+  sampler->interval_ms = config->sample_interval_min_ms;
+  sampler->has_sample = false;
+}
+
+// Function to feed a sensor reading to the sampler
+// Returns the interval in milliseconds until the next sample should be taken
+int sampler_update(AdaptiveSampler* sampler, const ConfigData* config, int value) {
+  long now = monotonic_ms();
+  if (sampler->has_sample) {
+    long elapsed = now - sampler->last_sample_ms;
+    long change = (value > sampler->last_value) ? value - sampler->last_value : sampler->last_value - value;
+    // Rate of change in sensor units per second
+    long derivative = change * 1000 / ((elapsed > 0) ? elapsed : 1);
+    if (derivative > config->adapt_threshold) {
+      sampler->interval_ms = config->sample_interval_min_ms;
+    } else {
+      // Rounded up, so short intervals still grow by at least 1 ms
+      long interval = ((long)sampler->interval_ms * config->adapt_growth_percent + 99) / 100;
+      sampler->interval_ms = (interval > config->sample_interval_max_ms) ? config->sample_interval_max_ms : (int)interval;
+    }
+  }
+  sampler->last_value = value;
+  sampler->last_sample_ms = now;
+  sampler->has_sample = true;
+  return sampler->interval_ms;
+}
+
+// Structure holding the state of the sensor filter chain
+// All buffers are fixed size, so filtering a sample never allocates
+typedef struct {
+  int ring[MAX_MEDIAN_WINDOW];
+  int sorted[MAX_MEDIAN_WINDOW];
+  int median_count;
+  int median_head;
+  long ema;
+  bool ema_valid;
+  long smooth;
+  long smooth_ms;
+  bool smooth_valid;
+  int spike_reference;
+  int spike_run;
+  bool spike_valid;
+  unsigned long rejected_spikes;
+  int raw_value;
+  int value;
+} SensorFilter;
+
+// Function to clear the history of every filter stage
+void filter_reset(SensorFilter* filter) {
+  filter->median_count = 0;
+  filter->median_head = 0;
+  filter->ema_valid = false;
+  filter->smooth_valid = false;
+  filter->spike_valid = false;
+  filter->spike_run = 0;
+}
+
+// Spike rejection: a jump larger than spike_percent of the last accepted value
+// is ignored until it persisted for spike_count consecutive samples
+int filter_spike(SensorFilter* filter, const FilterConfig* config, int value) {
+  if (!filter->spike_valid) {
+    filter->spike_reference = value;
+    filter->spike_valid = true;
+    return value;
+  }
+  long threshold = (long)filter->spike_reference * config->spike_percent / 100;
+  long difference = (long)value - filter->spike_reference;
+  if (threshold < 1) {
+    threshold = 1;
+  }
+  if ((difference > threshold || difference < -threshold) && ++filter->spike_run < config->spike_count) {
+    filter->rejected_spikes++;
+    return filter->spike_reference;
+  }
+  filter->spike_reference = value;
+  filter->spike_run = 0;
+  return value;
+}
+
+// Median over a ring buffer, the sorted copy is updated in O(window)
+int filter_median(SensorFilter* filter, const FilterConfig* config, int value) {
+  int window = config->median_window;
+  int count = filter->median_count;
+  if (count == window) {
+    // Drop the oldest sample from the sorted copy
+    int oldest = filter->ring[filter->median_head];
+    int i = 0;
+    while (i < count - 1 && filter->sorted[i] != oldest) {
+      i++;
+    }
+    memmove(&filter->sorted[i], &filter->sorted[i + 1], (size_t)(count - 1 - i) * sizeof(int));
+    count--;
+  }
+  filter->ring[filter->median_head] = value;
+  filter->median_head = (filter->median_head + 1) % window;
+  int i = count;
+  while (i > 0 && filter->sorted[i - 1] > value) {
+    filter->sorted[i] = filter->sorted[i - 1];
+    i--;
+  }
+  filter->sorted[i] = value;
+  filter->median_count = count + 1;
+  return filter->sorted[filter->median_count / 2];
+}
+
+// Exponential moving average in 24.8 fixed point
+int filter_ema(SensorFilter* filter, const FilterConfig* config, int value) {
+  long scaled = (long)value << 8;
+  if (!filter->ema_valid) {
+    filter->ema = scaled;
+    filter->ema_valid = true;
+  } else {
+    filter->ema += (scaled - filter->ema) * config->ema_alpha_percent / 100;
+  }
+  return (int)((filter->ema + 128) >> 8);
+}
+
+// First order low pass with separate time constants for brightening and dimming
+int filter_asymmetric(SensorFilter* filter, const FilterConfig* config, int value, long now_ms) {
+  long scaled = (long)value << 8;
+  if (!filter->smooth_valid) {
+    filter->smooth = scaled;
+    filter->smooth_ms = now_ms;
+    filter->smooth_valid = true;
+    return value;
+  }
+  long elapsed = now_ms - filter->smooth_ms;
+  long tau = (scaled > filter->smooth) ? config->brighten_ms : config->dim_ms;
+  filter->smooth_ms = now_ms;
+  if (tau <= 0 || elapsed <= 0) {
+    filter->smooth = (tau <= 0) ? scaled : filter->smooth;
+  } else {
+    filter->smooth += (scaled - filter->smooth) * elapsed / (tau + elapsed);
+  }
+  return (int)((filter->smooth + 128) >> 8);
+}
+
+// Function to run a raw sensor reading through the configured filter chain
+int filter_apply(SensorFilter* filter, const FilterConfig* config, int value, long now_ms) {
+  filter->raw_value = value;
+  for (int i = 0; i < config->stage_count; i++) {
+    switch (config->stages[i]) {
+      case FILTER_SPIKE:
+        value = filter_spike(filter, config, value);
+        break;
+      case FILTER_MEDIAN:
+        value = filter_median(filter, config, value);
+        break;
+      case FILTER_EMA:
+        value = filter_ema(filter, config, value);
+        break;
+      case FILTER_ASYMMETRIC:
+        value = filter_asymmetric(filter, config, value, now_ms);
+        break;
+    }
+  }
+  filter->value = value;
+  return value;
+}
+
+// Structure holding a lux to brightness curve compiled into a lookup table
+// Entries are fractions of max_brightness in 16.16 fixed point, indexed by
+// the sensor value shifted right by shift. The extra entry allows
+// interpolating the last interval without a bounds check.
+typedef struct {
+  int shift;
+  int max_input;
+  int table[CURVE_TABLE_SIZE + 1];
+} BrightnessCurve;
+
+// Function to evaluate the configured curve as a fraction of max_brightness
+// Only used while compiling the lookup table
+double evaluate_curve(const CurveConfig* config, double brightness_factor, int max_brightness, double input) {
+  if (config->type == CURVE_POINTS) {
+    int last = config->point_count - 1;
+    if (input <= config->point_input[0]) {
+      return config->point_percent[0] / 100.0;
+    }
+    for (int i = 1; i <= last; i++) {
+      if (input <= config->point_input[i]) {
+        double span = config->point_input[i] - config->point_input[i - 1];
+        double position = (input - config->point_input[i - 1]) / span;
+        return (config->point_percent[i - 1] + position * (config->point_percent[i] - config->point_percent[i - 1])) / 100.0;
+      }
+    }
+    return config->point_percent[last] / 100.0;
+  } else if (config->type == CURVE_GAMMA) {
+    double position = input / config->max_input;
+    return pow((position > 1.0) ? 1.0 : position, 1.0 / config->gamma);
+  }
+  double fraction = input * brightness_factor / max_brightness;
+  return (fraction > 1.0) ? 1.0 : fraction;
+}
+
+// Function to compile the configured curve into a lookup table
+void compile_curve(BrightnessCurve* curve, const OutputConfig* config, int max_brightness) {
+  const CurveConfig* curve_config = &config->curve;
+  int max_input;
+  if (curve_config->type == CURVE_POINTS) {
+    max_input = curve_config->point_input[curve_config->point_count - 1];
+  } else if (curve_config->type == CURVE_GAMMA) {
+    max_input = curve_config->max_input;
+  } else {
+    // The legacy linear mapping saturates where input * factor reaches max_brightness
+    max_input = (config->brightness_factor > 0) ? (int)(max_brightness / config->brightness_factor) : 1;
+  }
+  if (max_input < 1) {
+    max_input = 1;
+  }
+  // Smallest shift that makes every input up to max_input fit into the table
+  int shift = 0;
+  while ((max_input >> shift) >= CURVE_TABLE_SIZE) {
+    shift++;
+  }
+  curve->shift = shift;
+  curve->max_input = max_input;
+  for (int i = 0; i <= CURVE_TABLE_SIZE; i++) {
+    double fraction = evaluate_curve(curve_config, config->brightness_factor, max_brightness, (double)((long)i << shift));
+    curve->table[i] = (int)(fraction * 65536.0 + 0.5);
+  }
+}
+
+// Function to map a sensor value to a brightness with the lookup table
+int curve_lookup(const BrightnessCurve* curve, int input, int max_brightness) {
+  if (input < 0) {
+    input = 0;
+  } else if (input > curve->max_input) {
+    input = curve->max_input;
+  }
+  int index = input >> curve->shift;
+  int remainder = input & ((1 << curve->shift) - 1);
+  long fraction = curve->table[index] + (((long)(curve->table[index + 1] - curve->table[index]) * remainder) >> curve->shift);
+  // Round to the nearest step, truncating put every point one step low
+  return (int)((fraction * max_brightness + 0x8000) >> 16);
+}
+
+typedef struct Daemon Daemon;
+
+// Structure holding the attributes that tell if the display of an output is on
+// Backlights have bl_power, a DRM connector adds its dpms and enabled state.
+// Outputs without any of them, like keyboard LEDs, follow the other outputs.
+typedef struct {
+  SysfsAttribute bl_power;
+  SysfsAttribute dpms;
+  SysfsAttribute enabled;
+} DisplayPower;
+
+// Structure holding the runtime state of one output of the device registry
+typedef struct {
+  const OutputConfig* config;
+  Daemon* daemon;
+  Backlight backlight;
+  Transition transition;
+  BrightnessCurve curve;
+  EventSource change_source;
+  DisplayPower power;
+  bool available;
+  bool paused;
+  int ambient_value;
+  int ambient_offset;
+  int sensor_index;
+  int min_value;
+  int max_value;
+  int published_current;
+  int published_target;
+} Output;
+
+#define MAX_SCAN_CHANNELS 16
+#define MAX_CAPTURE_SCANS 64
+
+// Storage format of a channel in an IIO scan, parsed from scan_elements
+// The format reads [be|le]:[s|u]bits/storagebits[Xrepeat]>>shift
+typedef struct {
+  bool big_endian;
+  bool is_signed;
+  int bits;
+  int storage_bits;
+  int repeat;
+  int shift;
+} ScanType;
+
+// Structure holding a running IIO buffered capture of a sensor
+// The channel is found at offset within every record of record_size bytes
+typedef struct {
+  bool active;
+  bool from_file;
+  ScanType type;
+  int offset;
+  int record_size;
+  long last_sample_ms;
+} BufferCapture;
+
+// Function to parse the type descriptor of a scan element
+int parse_scan_type(const char* text, ScanType* type) {
+  char endian, sign;
+  unsigned int bits, storage_bits, repeat = 1, shift;
+  if (sscanf(text, "%ce:%c%u/%uX%u>>%u", &endian, &sign, &bits, &storage_bits, &repeat, &shift) != 6 &&
+      sscanf(text, "%ce:%c%u/%u>>%u", &endian, &sign, &bits, &storage_bits, &shift) != 5) {
+    return -1;
+  }
+  if ((endian != 'b' && endian != 'l') || (sign != 's' && sign != 'u') || bits == 0 || bits > 64 ||
+      (storage_bits != 8 && storage_bits != 16 && storage_bits != 32 && storage_bits != 64) ||
+      bits + shift > storage_bits || repeat == 0) {
+    return -1;
+  }
+  type->big_endian = (endian == 'b');
+  type->is_signed = (sign == 's');
+  type->bits = (int)bits;
+  type->storage_bits = (int)storage_bits;
+  type->repeat = (int)repeat;
+  type->shift = (int)shift;
+  return 0;
+}
+
+// Function to extract the value of a channel from a scan record
+int decode_scan_value(const unsigned char* record, const ScanType* type) {
+  int bytes = type->storage_bits / 8;
+  uint64_t raw = 0;
+  for (int i = 0; i < bytes; i++) {
+    int index = type->big_endian ? i : bytes - 1 - i;
+    raw = (raw << 8) | record[index];
+  }
+  raw >>= type->shift;
+  uint64_t mask = (type->bits == 64) ? ~0ull : (1ull << type->bits) - 1;
+  raw &= mask;
+  if (type->is_signed && (raw & (1ull << (type->bits - 1)))) {
+    return (int)(int64_t)(raw | ~mask);
+  }
+  return (raw > INT32_MAX) ? INT32_MAX : (int)raw;
+}
+
+// Function to write an integer to a sysfs attribute that is not kept open
+int write_attribute_once(const char* directory, const char* filename, int value) {
+  SysfsAttribute attribute;
+  if (attribute_open(&attribute, directory, filename, O_WRONLY) == -1) {
+    return -1;
+  }
+  int result = attribute_write_int(&attribute, value);
+  attribute_close(&attribute);
+  return result;
+}
+
+// Function to read a sysfs attribute as a string without the newline
+int read_attribute_once(const char* directory, const char* filename, char* buffer, size_t size) {
+  char path[MAX_PATH_LENGTH];
+  snprintf(path, sizeof(path), "%s/%s", directory, filename);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+  ssize_t length = read(fd, buffer, size - 1);
+  close(fd);
+  if (length <= 0) {
+    return -1;
+  }
+  buffer[length] = '\0';
+  buffer[strcspn(buffer, "\n")] = '\0';
+  return 0;
+}
+
+// Function to compute where a channel sits in the scans of a device
+// Enabled channels are stored in index order, each aligned to its storage
+// size, and the record is padded to the largest storage size
+int compute_scan_layout(const char* device_path, const char* channel, BufferCapture* capture) {
+  char directory[MAX_PATH_LENGTH];
+  snprintf(directory, sizeof(directory), "%s/scan_elements", device_path);
+  DIR* dir = opendir(directory);
+  if (dir == NULL) {
+    return -1;
+  }
+  struct {
+    int index;
+    int bytes;
+    bool ours;
+    ScanType type;
+  } channels[MAX_SCAN_CHANNELS];
+  int count = 0;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL && count < MAX_SCAN_CHANNELS) {
+    size_t length = strlen(entry->d_name);
+    if (length <= 3 || strcmp(entry->d_name + length - 3, "_en") != 0) {
+      continue;
+    }
+    char name[256], filename[300], value[64];
+    snprintf(name, sizeof(name), "%.*s", (int)(length - 3), entry->d_name);
+    if (read_attribute_once(directory, entry->d_name, value, sizeof(value)) == -1 || atoi(value) != 1) {
+      continue;
+    }
+    snprintf(filename, sizeof(filename), "%s_index", name);
+    if (read_attribute_once(directory, filename, value, sizeof(value)) == -1) {
+      continue;
+    }
+    channels[count].index = atoi(value);
+    snprintf(filename, sizeof(filename), "%s_type", name);
+    if (read_attribute_once(directory, filename, value, sizeof(value)) == -1 ||
+        parse_scan_type(value, &channels[count].type) == -1) {
+      continue;
+    }
+    // Like the kernel, repeated channels are aligned to their whole size
+    channels[count].bytes = channels[count].type.storage_bits / 8 * channels[count].type.repeat;
+    channels[count].ours = (strcmp(name, channel) == 0);
+    count++;
+  }
+  closedir(dir);
+
+  int offset = 0;
+  int largest = 1;
+  bool found = false;
+  for (int done = 0; done < count; done++) {
+    // Take the channel with the lowest index that is not placed yet
+    int next = -1;
+    for (int i = 0; i < count; i++) {
+      if (channels[i].bytes > 0 && (next == -1 || channels[i].index < channels[next].index)) {
+        next = i;
+      }
+    }
+    // ALIGN() of the kernel, which masks instead of dividing
+    int alignment = channels[next].bytes;
+    offset = (offset + alignment - 1) & ~(alignment - 1);
+    if (channels[next].ours) {
+      capture->type = channels[next].type;
+      capture->offset = offset;
+      found = true;
+    }
+    offset += channels[next].bytes;
+    if (alignment > largest) {
+      largest = alignment;
+    }
+    channels[next].bytes = 0;
+  }
+  capture->record_size = (offset + largest - 1) & ~(largest - 1);
+  return found ? 0 : -1;
+}
+
+// Structure holding the IIO threshold events of a sensor
+// Once the light settled, the band around the reading is programmed into
+// the rising and falling thresholds and the sensor is not sampled until an
+// event reports that the light left the band
+typedef struct {
+  bool active;
+  bool armed;
+  char rising_value[128];
+  char falling_value[128];
+  char rising_enable[128];
+  char falling_enable[128];
+} ThresholdEvents;
+
+#define MAX_RANGE_SETTINGS 16
+#define NANO 1000000000LL
+
+// Structure holding the calibration and auto ranging state of a sensor
+// Decimal attributes are kept as fixed point integers in units of 1e-9.
+// settings lists the values of the range attribute, which is the scale or
+// else the integration time, ordered from the most to the least sensitive.
+typedef struct {
+  bool calibrated;
+  int64_t scale;
+  int64_t offset;
+  char scale_attribute[128];
+  char offset_attribute[128];
+  bool ranging;
+  char range_attribute[128];
+  char settings[MAX_RANGE_SETTINGS][24];
+  int setting_count;
+  int setting;
+  int64_t frequencies[MAX_RANGE_SETTINGS];
+  int frequency_count;
+  char frequency_attribute[128];
+  int matched_interval_ms;
+  int raw_value;
+  int64_t gain;
+} SensorRange;
+
+// Function to parse a decimal attribute into fixed point units of 1e-9
+int parse_decimal(const char* text, int64_t* value) {
+  while (*text == ' ') {
+    text++;
+  }
+  bool negative = (*text == '-');
+  if (*text == '-' || *text == '+') {
+    text++;
+  }
+  if ((*text < '0' || *text > '9') && *text != '.') {
+    return -1;
+  }
+  int64_t integer = 0;
+  while (*text >= '0' && *text <= '9') {
+    integer = integer * 10 + (*text++ - '0');
+    if (integer > INT32_MAX) {
+      return -1;
+    }
+  }
+  int64_t fraction = 0;
+  int64_t unit = NANO;
+  if (*text == '.') {
+    text++;
+    while (*text >= '0' && *text <= '9') {
+      if (unit > 1) {
+        unit /= 10;
+        fraction += (*text - '0') * unit;
+      }
+      text++;
+    }
+  }
+  *value = integer * NANO + fraction;
+  if (negative) {
+    *value = -*value;
+  }
+  return 0;
+}
+
+// Structure holding the runtime state of one sensor of the device registry
+// Every sample is fanned out to all outputs that follow the sensor
+typedef struct Sensor {
+  const SensorConfig* config;
+  Daemon* daemon;
+  char device_path[MAX_PATH_LENGTH];
+  SysfsAttribute attribute;
+  AdaptiveSampler sampler;
+  SensorFilter filter;
+  EventSource timer;
+  EventSource capture_source;
+  BufferCapture capture;
+  EventSource event_source;
+  ThresholdEvents events;
+  SensorRange range;
+  struct Sensor* members[MAX_SENSORS];
+  int member_count;
+  unsigned long outliers;
+  uint32_t burst_variance;
+  bool available;
+  unsigned long samples;
+  int published_value;
+  Output* outputs[MAX_OUTPUTS];
+  int output_count;
+} Sensor;
+
+// Kinds of device changes reported by the hotplug monitor
+typedef enum {
+  HOTPLUG_ADD,
+  HOTPLUG_REMOVE,
+  HOTPLUG_CHANGE
+} HotplugAction;
+
+// Structure describing one device change
+// The subsystem is empty when the backend cannot tell it
+typedef struct {
+  int action;
+  char devpath[MAX_PATH_LENGTH];
+  char subsystem[32];
+} HotplugEvent;
+
+#define MAX_HOTPLUG_DIRECTORIES 8
+
+typedef struct HotplugMonitor HotplugMonitor;
+
+// Structure describing a source of hotplug events
+// next_event returns 1 for an event, 0 for an ignored message and -1 once drained
+typedef struct {
+  const char* name;
+  int (*open)(HotplugMonitor* monitor, const ConfigData* config);
+  int (*next_event)(HotplugMonitor* monitor, HotplugEvent* event);
+} HotplugBackend;
+
+// Structure holding the state of the hotplug monitor
+struct HotplugMonitor {
+  const HotplugBackend* backend;
+  EventSource source;
+  Daemon* daemon;
+  char buffer[8192];
+  size_t length;
+  size_t offset;
+  int watches[MAX_HOTPLUG_DIRECTORIES];
+  char directories[MAX_HOTPLUG_DIRECTORIES][256];
+  int directory_count;
+};
+
+// Structure holding a pending event of a subscribed client
+typedef struct {
+  uint16_t type;
+  BmEventData data;
+} PendingEvent;
+
+// Structure holding a connection of the control socket
+// Events for a slow subscriber are kept in a bounded queue. A newer event
+// for the same output or sensor replaces the queued one, and when the queue
+// is full the oldest event is dropped.
+typedef struct {
+  EventSource source;
+  Daemon* daemon;
+  bool in_use;
+  uint32_t subscriptions;
+  PendingEvent queue[MAX_PENDING_EVENTS];
+  int queue_head;
+  int queue_count;
+  BmResponse pending_response;
+  bool has_pending_response;
+  bool waiting_for_write;
+  uint32_t epoll_events;
+} Client;
+
+// Structure holding an evdev device that delivers brightness keys
+typedef struct {
+  EventSource source;
+  Daemon* daemon;
+  char path[MAX_PATH_LENGTH];
+  int step; // Percent of the next key repeat, grows while a key is held
+} InputDevice;
+
+// Structure holding the runtime state of the daemon event loop
+struct Daemon {
+  ConfigData* config;
+  Output outputs[MAX_OUTPUTS];
+  int output_count;
+  Sensor sensors[MAX_SENSORS];
+  int sensor_count;
+  bool ambient_mode;
+  bool published_ambient_mode;
+  bool running;
+  long started_ms;
+  unsigned long wakeups;
+  unsigned long dropped_events;
+  int epoll_fd;
+  EventSource control;
+  EventSource signals;
+  EventSource listener;
+  char socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+  Client clients[MAX_CLIENTS];
+  HotplugMonitor hotplug;
+  BmStatusPage* status;
+  char status_path[MAX_PATH_LENGTH];
+  BmCommandRing* ring;
+  int ring_fd;
+  EventSource doorbell;
+  InputDevice inputs[MAX_INPUT_DEVICES];
+  int input_count;
+  EventSource reconcile;
+  EventSource clock;
+  int64_t suspended_ns;
+  unsigned long resumes;
+  unsigned long clock_resumes;
+  EventSource display_probe;
+  bool display_on;
+  long display_checked_ms;
+};
+
+// Check if sensors should be sampled for ambient mode
+// Nothing is sampled while the display is off
+bool ambient_active(const Daemon* daemon) {
+  return daemon->ambient_mode && daemon->display_on;
+}
+
+// Function to arm a sensor sampling timer as a one shot after delay_ms
+// A delay of -1 disarms the timer, so the daemon sleeps until a command arrives
+void arm_sensor_timer(Sensor* sensor, int delay_ms) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (delay_ms == 0) {
+    spec.it_value.tv_nsec = 1;
+  } else if (delay_ms > 0) {
+    spec.it_value.tv_sec = delay_ms / 1000;
+    spec.it_value.tv_nsec = (delay_ms % 1000) * 1000000L;
+  }
+  if (timerfd_settime(sensor->timer.fd, 0, &spec, NULL) == -1) {
+    perror("Error arming the ambient timer");
+  }
+}
+
+// Function to start or stop the conversions of a buffered capture
+// Stale scans are dropped on start, so the filters see current light only
+void set_capture_enabled(Sensor* sensor, bool enabled) {
+  BufferCapture* capture = &sensor->capture;
+  if (!capture->active) {
+    return;
+  }
+  if (!capture->from_file) {
+    if (write_attribute_once(sensor->device_path, "buffer/enable", enabled ? 1 : 0) == -1) {
+      perror("Error switching the sensor buffer");
+    }
+    if (enabled) {
+      unsigned char scans[MAX_CAPTURE_SCANS * 64];
+      while (read(sensor->capture_source.fd, scans, sizeof(scans)) > 0) {
+      }
+    }
+  }
+  capture->last_sample_ms = monotonic_ms();
+}
+
+// Function to close the buffered capture of a sensor
+void close_capture(Sensor* sensor) {
+  if (sensor->capture.active) {
+    set_capture_enabled(sensor, false);
+    epoll_ctl(sensor->daemon->epoll_fd, EPOLL_CTL_DEL, sensor->capture_source.fd, NULL);
+    close(sensor->capture_source.fd);
+    sensor->capture_source.fd = -1;
+    sensor->capture.active = false;
+  }
+}
+
+// Function to set up the IIO buffer of a sensor
+// The channel of sensor_file is enabled in scan_elements, the buffer length,
+// watermark and trigger are configured and the character device is opened.
+// The buffer stays disabled until ambient mode starts. Returns -1 if the
+// device has no usable buffer, the sensor is then read through sysfs.
+int open_capture(Sensor* sensor) {
+  const SensorConfig* config = sensor->config;
+  BufferCapture* capture = &sensor->capture;
+  memset(capture, 0, sizeof(*capture));
+  char channel[256];
+  size_t length = strlen(config->sensor_file);
+  if (length > 4 && strcmp(config->sensor_file + length - 4, "_raw") == 0) {
+    length -= 4;
+  }
+  snprintf(channel, sizeof(channel), "%.*s", (int)length, config->sensor_file);
+
+  char filename[300];
+  snprintf(filename, sizeof(filename), "scan_elements/%s_en", channel);
+  write_attribute_once(sensor->device_path, "buffer/enable", 0);
+  if (write_attribute_once(sensor->device_path, filename, 1) == -1 ||
+      write_attribute_once(sensor->device_path, "buffer/length", config->buffer_length) == -1) {
+    return -1;
+  }
+  // Older kernels have no watermark, they wake the reader for every scan
+  write_attribute_once(sensor->device_path, "buffer/watermark", config->buffer_watermark);
+  if (config->buffer_trigger[0] != '\0') {
+    SysfsAttribute trigger;
+    if (attribute_open(&trigger, sensor->device_path, "trigger/current_trigger", O_WRONLY) == -1 ||
+        write(trigger.fd, config->buffer_trigger, strlen(config->buffer_trigger)) == -1) {
+      perror("Error setting the sensor trigger");
+    }
+    attribute_close(&trigger);
+  }
+  if (compute_scan_layout(sensor->device_path, channel, capture) == -1) {
+    return -1;
+  }
+
+  char device[MAX_PATH_LENGTH + 8];
+  capture->from_file = (config->buffer_file[0] != '\0');
+  if (capture->from_file) {
+    strncpy(device, config->buffer_file, sizeof(device) - 1);
+    device[sizeof(device) - 1] = '\0';
+  } else {
+    const char* name = strrchr(sensor->device_path, '/');
+    snprintf(device, sizeof(device), "/dev/%s", (name != NULL) ? name + 1 : sensor->device_path);
+  }
+  sensor->capture_source.fd = open(device, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (sensor->capture_source.fd == -1) {
+    return -1;
+  }
+  // A regular file cannot be polled, it is read on the sensor timer instead
+  if (!capture->from_file && add_event_source(sensor->daemon->epoll_fd, &sensor->capture_source, EPOLLIN) == -1) {
+    close(sensor->capture_source.fd);
+    sensor->capture_source.fd = -1;
+    return -1;
+  }
+  capture->active = true;
+  return 0;
+}
+
+// Function to find the threshold attribute of a channel
+// Drivers name it after the channel or after the channel type only, and
+// some share one enable attribute between both directions
+bool find_event_attribute(const char* device_path, const char* channel, const char* direction,
+                          const char* suffix, char* filename, size_t size) {
+  char type[128];
+  // in_intensity_both becomes in_intensity
+  const char* separator = strchr(channel + 3, '_');
+  snprintf(type, sizeof(type), "%.*s", (separator != NULL) ? (int)(separator - channel) : (int)strlen(channel), channel);
+  const char* names[] = { channel, type };
+  const char* directions[] = { direction, "either" };
+  for (int i = 0; i < 2; i++) {
+    for (int j = 0; j < 2; j++) {
+      if (j == 1 && strcmp(suffix, "en") != 0) {
+        break;
+      }
+      char path[MAX_PATH_LENGTH];
+      snprintf(filename, size, "events/%s_thresh_%s_%s", names[i], directions[j], suffix);
+      snprintf(path, sizeof(path), "%s/%s", device_path, filename);
+      if (access(path, W_OK) == 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Function to switch the threshold events of a sensor on or off
+void set_events_enabled(Sensor* sensor, bool enabled) {
+  ThresholdEvents* events = &sensor->events;
+  if (write_attribute_once(sensor->device_path, events->rising_enable, enabled) == -1 ||
+      write_attribute_once(sensor->device_path, events->falling_enable, enabled) == -1) {
+    perror("Error switching the threshold events");
+  }
+  events->armed = enabled;
+}
+
+// Function to program the band around a reading and wait for it to be left
+void arm_events(Sensor* sensor, int value) {
+  const SensorConfig* config = sensor->config;
+  int band = (int)((long)value * config->event_band_percent / 100);
+  if (band < config->event_band_min) {
+    band = config->event_band_min;
+  }
+  int low = (value > band) ? value - band : 0;
+  if (write_attribute_once(sensor->device_path, sensor->events.falling_value, low) == -1 ||
+      write_attribute_once(sensor->device_path, sensor->events.rising_value, value + band) == -1) {
+    perror("Error setting the sensor thresholds");
+  }
+  set_events_enabled(sensor, true);
+}
+
+// Function to close the threshold events of a sensor
+void close_events(Sensor* sensor) {
+  if (sensor->events.active) {
+    if (sensor->events.armed) {
+      set_events_enabled(sensor, false);
+    }
+    epoll_ctl(sensor->daemon->epoll_fd, EPOLL_CTL_DEL, sensor->event_source.fd, NULL);
+    close(sensor->event_source.fd);
+    sensor->event_source.fd = -1;
+    sensor->events.active = false;
+  }
+}
+
+// Function to set up the threshold events of a sensor
+// The event descriptor is taken from the IIO character device with
+// IIO_GET_EVENT_FD_IOCTL. Returns -1 if the sensor has no threshold events,
+// it is then polled by the adaptive sampler.
+int open_events(Sensor* sensor) {
+  const SensorConfig* config = sensor->config;
+  ThresholdEvents* events = &sensor->events;
+  memset(events, 0, sizeof(*events));
+  char channel[256];
+  size_t length = strlen(config->sensor_file);
+  if (length > 4 && strcmp(config->sensor_file + length - 4, "_raw") == 0) {
+    length -= 4;
+  }
+  snprintf(channel, sizeof(channel), "%.*s", (int)length, config->sensor_file);
+  if (strncmp(channel, "in_", 3) != 0 ||
+      !find_event_attribute(sensor->device_path, channel, "rising", "value", events->rising_value, sizeof(events->rising_value)) ||
+      !find_event_attribute(sensor->device_path, channel, "falling", "value", events->falling_value, sizeof(events->falling_value)) ||
+      !find_event_attribute(sensor->device_path, channel, "rising", "en", events->rising_enable, sizeof(events->rising_enable)) ||
+      !find_event_attribute(sensor->device_path, channel, "falling", "en", events->falling_enable, sizeof(events->falling_enable))) {
+    return -1;
+  }
+
+  int fd = -1;
+  if (config->event_file[0] != '\0') {
+    // O_RDWR keeps a named pipe open when its writer goes away
+    fd = open(config->event_file, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  } else {
+    char device[MAX_PATH_LENGTH + 8];
+    const char* name = strrchr(sensor->device_path, '/');
+    snprintf(device, sizeof(device), "/dev/%s", (name != NULL) ? name + 1 : sensor->device_path);
+    int device_fd = open(device, O_RDONLY | O_CLOEXEC);
+    if (device_fd != -1) {
+      if (ioctl(device_fd, IIO_GET_EVENT_FD_IOCTL, &fd) == -1) {
+        fd = -1;
+      }
+      close(device_fd);
+    }
+    if (fd != -1) {
+      fcntl(fd, F_SETFL, O_NONBLOCK);
+    }
+  }
+  if (fd == -1) {
+    return -1;
+  }
+  sensor->event_source.fd = fd;
+  if (add_event_source(sensor->daemon->epoll_fd, &sensor->event_source, EPOLLIN) == -1) {
+    close(fd);
+    sensor->event_source.fd = -1;
+    return -1;
+  }
+  set_events_enabled(sensor, false);
+  events->active = true;
+  return 0;
+}
+
+// Function to find an attribute of a channel
+// Drivers name it after the channel, after the channel type or after the device
+bool find_channel_attribute(const char* device_path, const char* channel, const char* suffix,
+                            char* filename, size_t size) {
+  char type[128];
+  const char* separator = strchr(channel + 3, '_');
+  snprintf(type, sizeof(type), "%.*s", (separator != NULL) ? (int)(separator - channel) : (int)strlen(channel), channel);
+  char names[3][160];
+  snprintf(names[0], sizeof(names[0]), "%s_%s", channel, suffix);
+  snprintf(names[1], sizeof(names[1]), "%s_%s", type, suffix);
+  snprintf(names[2], sizeof(names[2]), "%s", suffix);
+  for (int i = 0; i < 3; i++) {
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/%s", device_path, names[i]);
+    if (access(path, R_OK) == 0) {
+      snprintf(filename, size, "%s", names[i]);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Function to read a decimal attribute of a sensor
+int read_decimal_attribute(const Sensor* sensor, const char* filename, int64_t* value) {
+  char text[64];
+  if (filename[0] == '\0' || read_attribute_once(sensor->device_path, filename, text, sizeof(text)) == -1) {
+    return -1;
+  }
+  return parse_decimal(text, value);
+}
+
+// Function to read the scale and offset that turn raw readings into lux
+void read_calibration(Sensor* sensor) {
+  SensorRange* range = &sensor->range;
+  range->scale = NANO;
+  range->offset = 0;
+  read_decimal_attribute(sensor, range->scale_attribute, &range->scale);
+  read_decimal_attribute(sensor, range->offset_attribute, &range->offset);
+}
+
+// Function to read a list of decimal values such as a *_available attribute
+// Returns the number of values, the texts are kept if texts is not NULL
+int read_decimal_list(const Sensor* sensor, const char* filename, int64_t* values, char (*texts)[24], int max_count) {
+  char text[256];
+  if (read_attribute_once(sensor->device_path, filename, text, sizeof(text)) == -1) {
+    return 0;
+  }
+  int count = 0;
+  char* save = NULL;
+  for (char* token = strtok_r(text, " ", &save); token != NULL && count < max_count; token = strtok_r(NULL, " ", &save)) {
+    if (parse_decimal(token, &values[count]) == 0) {
+      if (texts != NULL) {
+        snprintf(texts[count], sizeof(texts[count]), "%s", token);
+      }
+      count++;
+    }
+  }
+  return count;
+}
+
+// Function to set up calibration, auto ranging and sampling frequency matching
+// A missing attribute only disables the feature that needs it
+void open_range(Sensor* sensor) {
+  const SensorConfig* config = sensor->config;
+  SensorRange* range = &sensor->range;
+  memset(range, 0, sizeof(*range));
+  range->gain = (int64_t)llround(config->gain * 65536.0);
+  char channel[256];
+  size_t length = strlen(config->sensor_file);
+  if (length > 4 && strcmp(config->sensor_file + length - 4, "_raw") == 0) {
+    length -= 4;
+  }
+  snprintf(channel, sizeof(channel), "%.*s", (int)length, config->sensor_file);
+  if (strncmp(channel, "in_", 3) != 0) {
+    return;
+  }
+
+  if (config->lux) {
+    find_channel_attribute(sensor->device_path, channel, "scale", range->scale_attribute, sizeof(range->scale_attribute));
+    find_channel_attribute(sensor->device_path, channel, "offset", range->offset_attribute, sizeof(range->offset_attribute));
+    read_calibration(sensor);
+    range->calibrated = true;
+  }
+
+  // Raw readings would jump with every switch, only lux stays comparable
+  if (config->auto_range && !config->lux) {
+    fprintf(stderr, "Sensor %s only switches its range with units=lux\n", config->name);
+  } else if (config->auto_range) {
+    char available[160];
+    int64_t values[MAX_RANGE_SETTINGS];
+    char texts[MAX_RANGE_SETTINGS][24];
+    // A larger scale is less sensitive, a longer integration time more
+    bool ascending = true;
+    if (find_channel_attribute(sensor->device_path, channel, "scale_available", available, sizeof(available)) &&
+        find_channel_attribute(sensor->device_path, channel, "scale", range->range_attribute, sizeof(range->range_attribute))) {
+      range->setting_count = read_decimal_list(sensor, available, values, texts, MAX_RANGE_SETTINGS);
+    } else if (find_channel_attribute(sensor->device_path, channel, "integration_time_available", available, sizeof(available)) &&
+               find_channel_attribute(sensor->device_path, channel, "integration_time", range->range_attribute, sizeof(range->range_attribute))) {
+      range->setting_count = read_decimal_list(sensor, available, values, texts, MAX_RANGE_SETTINGS);
+      ascending = false;
+    }
+    // Sort from the most to the least sensitive setting
+    for (int i = 1; i < range->setting_count; i++) {
+      for (int j = i; j > 0 && (ascending ? values[j] < values[j - 1] : values[j] > values[j - 1]); j--) {
+        int64_t value = values[j];
+        values[j] = values[j - 1];
+        values[j - 1] = value;
+        char text[24];
+        memcpy(text, texts[j], sizeof(text));
+        memcpy(texts[j], texts[j - 1], sizeof(text));
+        memcpy(texts[j - 1], text, sizeof(text));
+      }
+    }
+    memcpy(range->settings, texts, sizeof(texts));
+    int64_t current;
+    range->setting = 0;
+    if (read_decimal_attribute(sensor, range->range_attribute, &current) == 0) {
+      for (int i = 0; i < range->setting_count; i++) {
+        if (values[i] == current) {
+          range->setting = i;
+        }
+      }
+    }
+    range->ranging = range->setting_count > 1;
+    if (!range->ranging) {
+      fprintf(stderr, "Sensor %s cannot switch its range\n", config->name);
+    }
+  }
+
+  if (config->match_sampling_frequency &&
+      find_channel_attribute(sensor->device_path, channel, "sampling_frequency", range->frequency_attribute, sizeof(range->frequency_attribute))) {
+    char available[160];
+    if (find_channel_attribute(sensor->device_path, channel, "sampling_frequency_available", available, sizeof(available))) {
+      range->frequency_count = read_decimal_list(sensor, available, range->frequencies, NULL, MAX_RANGE_SETTINGS);
+    }
+  }
+}
+
+// Function to switch the range when a raw reading leaves the headroom band
+// The reading that triggered the switch is still converted with the old
+// calibration, the next one already uses the new scale
+void auto_range(Sensor* sensor, int raw_value) {
+  const SensorConfig* config = sensor->config;
+  SensorRange* range = &sensor->range;
+  int next = range->setting;
+  if ((long)raw_value * 100 >= (long)config->range_raw_max * config->range_high_percent && next + 1 < range->setting_count) {
+    next++;
+  } else if ((long)raw_value * 100 <= (long)config->range_raw_max * config->range_low_percent && next > 0) {
+    next--;
+  }
+  if (next == range->setting) {
+    return;
+  }
+  SysfsAttribute attribute;
+  if (attribute_open(&attribute, sensor->device_path, range->range_attribute, O_WRONLY | O_TRUNC) == -1 ||
+      write(attribute.fd, range->settings[next], strlen(range->settings[next])) == -1) {
+    perror("Error switching the sensor range");
+    attribute_close(&attribute);
+    return;
+  }
+  attribute_close(&attribute);
+  range->setting = next;
+  if (range->calibrated) {
+    read_calibration(sensor);
+  }
+}
+
+// Function to convert a raw reading into lux in fixed point
+int sensor_to_lux(const SensorRange* range, int raw_value) {
+  __int128 value = ((__int128)raw_value * NANO + range->offset) * range->scale;
+  value = (value + (__int128)NANO * NANO / 2) / ((__int128)NANO * NANO);
+  return (value > INT32_MAX) ? INT32_MAX : (value < INT32_MIN) ? INT32_MIN : (int)value;
+}
+
+// Function to reduce a burst of readings to their trimmed mean
+// The readings are sorted in place and trim_percent of them are dropped at
+// either end. The variance is taken over the whole burst, so it still shows
+// the noise the trimming removed.
+int reduce_burst(int* values, int count, int trim_percent, uint32_t* variance) {
+  for (int i = 1; i < count; i++) {
+    for (int j = i; j > 0 && values[j] < values[j - 1]; j--) {
+      int swap = values[j];
+      values[j] = values[j - 1];
+      values[j - 1] = swap;
+    }
+  }
+  double mean = 0.0;
+  for (int i = 0; i < count; i++) {
+    mean += values[i];
+  }
+  mean /= count;
+  double deviation = 0.0;
+  for (int i = 0; i < count; i++) {
+    deviation += (values[i] - mean) * (values[i] - mean);
+  }
+  deviation /= count;
+  *variance = (deviation >= UINT32_MAX) ? UINT32_MAX : (uint32_t)llround(deviation);
+
+  int trim = count * trim_percent / 100;
+  int64_t total = 0;
+  for (int i = trim; i < count - trim; i++) {
+    total += values[i];
+  }
+  int kept = count - 2 * trim;
+  return (int)((total >= 0) ? (total + kept / 2) / kept : (total - kept / 2) / kept);
+}
+
+// Function to take burst_samples readings from a sensor in one wakeup
+// At least min_samples readings are taken, e.g. for a fresh reading after a resume.
+// Returns -1 with errno set if the first reading fails, a later failure just
+// shortens the burst
+int read_burst(Sensor* sensor, int min_samples, int* raw_value) {
+  const SensorConfig* config = sensor->config;
+  int samples = (min_samples > config->burst_samples) ? min_samples : config->burst_samples;
+  if (samples > MAX_BURST_SAMPLES) {
+    samples = MAX_BURST_SAMPLES;
+  }
+  if (attribute_read_int(&sensor->attribute, raw_value) == -1) {
+    return -1;
+  }
+  if (samples == 1) {
+    return 0;
+  }
+  int values[MAX_BURST_SAMPLES];
+  int count = 1;
+  values[0] = *raw_value;
+  while (count < samples && attribute_read_int(&sensor->attribute, &values[count]) == 0) {
+    count++;
+  }
+  *raw_value = reduce_burst(values, count, config->burst_trim_percent, &sensor->burst_variance);
+  return 0;
+}
+
+// Function to convert a raw reading to lux if calibrated and apply the sensor gain
+int scale_sample(const SensorRange* range, int raw_value) {
+  int value = range->calibrated ? sensor_to_lux(range, raw_value) : raw_value;
+  if (range->gain != 65536) {
+    int64_t scaled = ((int64_t)value * range->gain + 32768) >> 16;
+    value = (scaled > INT32_MAX) ? INT32_MAX : (scaled < INT32_MIN) ? INT32_MIN : (int)scaled;
+  }
+  return value;
+}
+
+// Function to process a raw reading, returns the value the filters work on
+int calibrate_sample(Sensor* sensor, int raw_value) {
+  SensorRange* range = &sensor->range;
+  range->raw_value = raw_value;
+  int value = scale_sample(range, raw_value);
+  if (range->ranging) {
+    auto_range(sensor, raw_value);
+  }
+  return value;
+}
+
+// Function to let the sensor convert just as often as the daemon reads it
+// The slowest supported frequency that still delivers a fresh value for
+// every read is chosen. It is only written when the interval changed.
+void match_sampling_frequency(Sensor* sensor, int interval_ms) {
+  SensorRange* range = &sensor->range;
+  if (range->frequency_attribute[0] == '\0' || interval_ms <= 0 || interval_ms == range->matched_interval_ms) {
+    return;
+  }
+  range->matched_interval_ms = interval_ms;
+  int64_t wanted = NANO * 1000 / interval_ms;
+  int64_t chosen = -1;
+  for (int i = 0; i < range->frequency_count; i++) {
+    if (range->frequencies[i] >= wanted && (chosen == -1 || range->frequencies[i] < chosen)) {
+      chosen = range->frequencies[i];
+    }
+  }
+  if (chosen == -1) {
+    chosen = wanted;
+    for (int i = 0; i < range->frequency_count; i++) {
+      // Slower than every supported frequency, take the slowest one
+      if (i == 0 || range->frequencies[i] < chosen) {
+        chosen = range->frequencies[i];
+      }
+    }
+  }
+  char text[32];
+  int length = snprintf(text, sizeof(text), "%lld.%06lld", (long long)(chosen / NANO), (long long)(chosen % NANO / 1000));
+  SysfsAttribute attribute;
+  if (attribute_open(&attribute, sensor->device_path, range->frequency_attribute, O_WRONLY | O_TRUNC) == -1 ||
+      write(attribute.fd, text, (size_t)length) == -1) {
+    perror("Error setting the sensor sampling frequency");
+  }
+  attribute_close(&attribute);
+}
+
+// Function to start sampling a sensor right away at the fastest rate
+// Buffered sensors get their capture enabled, the others their timer armed
+void start_sensor(Sensor* sensor) {
+  sampler_reset(&sensor->sampler, sensor->daemon->config);
+  filter_reset(&sensor->filter);
+  set_capture_enabled(sensor, true);
+  if (!sensor->capture.active || sensor->capture.from_file) {
+    arm_sensor_timer(sensor, 0);
+  }
+}
+
+// Function to start or stop ambient sampling
+// Only sensors that drive at least one available output are sampled
+void set_ambient_timer(Daemon* daemon, bool enabled) {
+  for (int i = 0; i < daemon->sensor_count; i++) {
+    Sensor* sensor = &daemon->sensors[i];
+    if (enabled && sensor->available && sensor->output_count > 0) {
+      start_sensor(sensor);
+    } else {
+      set_capture_enabled(sensor, false);
+      if (sensor->events.armed) {
+        set_events_enabled(sensor, false);
+      }
+      arm_sensor_timer(sensor, -1);
+    }
+  }
+}
+
+// Function to open a sensor, the hot path then only issues a pread per sample
+// Sensors found by scanning sensor_path are looked up again if they went away
+int open_sensor(Sensor* sensor) {
+  const SensorConfig* config = sensor->config;
+  if (config->fusion != FUSION_NONE && !config->explicit_path) {
+    // A fused sensor has no device, its members are opened on their own
+    sensor->available = true;
+    return 0;
+  }
+  if (sensor->device_path[0] == '\0' && !config->explicit_path) {
+    char* sensor_file_path = get_sensor_path(config->sensor_path, config->sensor_file);
+    if (sensor_file_path != NULL) {
+      strncpy(sensor->device_path, sensor_file_path, sizeof(sensor->device_path) - 1);
+      free(sensor_file_path);
+    }
+  }
+  if (sensor->device_path[0] == '\0' ||
+      attribute_open(&sensor->attribute, sensor->device_path, config->sensor_file, O_RDONLY) == -1) {
+    fprintf(stderr, "Sensor %s not available\n", config->name);
+    sensor->available = false;
+    return -1;
+  }
+  open_range(sensor);
+  if (config->capture == CAPTURE_BUFFER && open_capture(sensor) == -1) {
+    fprintf(stderr, "Sensor %s has no usable buffer, falling back to sysfs\n", config->name);
+  } else if (config->capture == CAPTURE_EVENTS && open_events(sensor) == -1) {
+    fprintf(stderr, "Sensor %s has no threshold events, falling back to polling\n", config->name);
+  }
+  sensor->available = true;
+  return 0;
+}
+
+// Function to close a sensor
+void close_sensor(Sensor* sensor) {
+  if (sensor->available) {
+    arm_sensor_timer(sensor, -1);
+    close_capture(sensor);
+    close_events(sensor);
+    attribute_close(&sensor->attribute);
+    sensor->available = false;
+    if (!sensor->config->explicit_path) {
+      sensor->device_path[0] = '\0';
+    }
+  }
+}
+
+// Function to move an output towards the brightness for a filtered sensor value
+// Outputs rebased after an external change keep the offset the user picked
+void apply_ambient_brightness(Output* output, int illumination) {
+  if (!output->available || output->paused) {
+    return;
+  }
+  const OutputConfig* config = output->config;
+  int backlight_value = curve_lookup(&output->curve, illumination, output->backlight.max_brightness);
+  if (backlight_value < output->min_value) {
+    backlight_value = output->min_value;
+  } else if (backlight_value > output->max_value) {
+    backlight_value = output->max_value;
+  }
+  output->ambient_value = backlight_value;
+  backlight_value += output->ambient_offset;
+  Transition* transition = &output->transition;
+  if (!within_deadband(&output->backlight, transition_target(transition), backlight_value, config->deadband_abs, config->deadband_percent)) {
+    transition_start(transition, backlight_value);
+  }
+}
+
+// Function to read every member of a fused sensor and combine the readings
+// Members are calibrated and scaled by their gain first. With three or more
+// readings, those too far from the median are dropped. With two, the lower
+// one is dropped when they disagree, as a covered sensor only reads too low.
+// Returns -1 if no member could be read.
+int read_fused_value(Sensor* sensor, int min_samples, int* value) {
+  const SensorConfig* config = sensor->config;
+  int values[MAX_SENSORS];
+  int weights[MAX_SENSORS];
+  int count = 0;
+  for (int i = 0; i < sensor->member_count; i++) {
+    Sensor* member = sensor->members[i];
+    int raw_value;
+    if (!member->available) {
+      continue;
+    }
+    if (read_burst(member, min_samples, &raw_value) == -1) {
+      if (attribute_is_stale(errno) || errno == ENOENT) {
+        close_sensor(member);
+      }
+      continue;
+    }
+    member->samples++;
+    values[count] = calibrate_sample(member, raw_value);
+    member->filter.raw_value = values[count];
+    member->filter.value = values[count];
+    weights[count] = member->config->fusion_weight;
+    count++;
+  }
+  if (count == 0) {
+    return -1;
+  }
+
+  int reference = values[0];
+  if (count >= 3) {
+    int sorted[MAX_SENSORS];
+    memcpy(sorted, values, sizeof(int) * count);
+    for (int i = 1; i < count; i++) {
+      for (int j = i; j > 0 && sorted[j] < sorted[j - 1]; j--) {
+        int swap = sorted[j];
+        sorted[j] = sorted[j - 1];
+        sorted[j - 1] = swap;
+      }
+    }
+    reference = sorted[count / 2];
+  } else if (count == 2 && values[1] > reference) {
+    reference = values[1];
+  }
+  long limit = (long)((reference > 0) ? reference : 1) * config->fusion_outlier_percent;
+  long total = 0;
+  long total_weight = 0;
+  int maximum = INT32_MIN;
+  for (int i = 0; i < count; i++) {
+    long deviation = (values[i] > reference) ? values[i] - reference : reference - values[i];
+    if (config->fusion_outlier_percent > 0 && deviation * 100 > limit) {
+      sensor->outliers++;
+      continue;
+    }
+    int weight = (config->fusion == FUSION_WEIGHTED) ? weights[i] : 1;
+    total += (long)values[i] * weight;
+    total_weight += weight;
+    if (values[i] > maximum) {
+      maximum = values[i];
+    }
+  }
+  if (config->fusion == FUSION_MAX) {
+    *value = maximum;
+  } else {
+    *value = (total_weight > 0) ? (int)((total + total_weight / 2) / total_weight) : maximum;
+  }
+  return 0;
+}
+
+// Function to sample a sensor and apply the ambient brightness to its outputs
+// Each read is a burst of at least min_samples readings.
+// Returns the delay in milliseconds until the next sample
+int update_ambient_brightness(Sensor* sensor, int min_samples) {
+  const ConfigData* config = sensor->daemon->config;
+  int value;
+  if (sensor->member_count > 0) {
+    if (read_fused_value(sensor, min_samples, &value) == -1) {
+      // Every member is gone, keep looking at the slowest rate
+      return config->sample_interval_max_ms;
+    }
+  } else {
+    int raw_illumination;
+    if (read_burst(sensor, min_samples, &raw_illumination) == -1) {
+      perror("Error reading the sensor file");
+      if (attribute_is_stale(errno) || errno == ENOENT) {
+        // The device is gone, wait for the hotplug monitor to bring it back
+        close_sensor(sensor);
+        return -1;
+      }
+      return config->sample_interval_max_ms;
+    }
+    value = calibrate_sample(sensor, raw_illumination);
+  }
+  sensor->samples++;
+  int next_sample_ms = sampler_update(&sensor->sampler, config, value);
+  match_sampling_frequency(sensor, next_sample_ms);
+  int illumination = filter_apply(&sensor->filter, &sensor->config->filter, value, sensor->sampler.last_sample_ms);
+  for (int i = 0; i < sensor->output_count; i++) {
+    apply_ambient_brightness(sensor->outputs[i], illumination);
+  }
+  return next_sample_ms;
+}
+
+// Function to run the scans of a buffered capture through the filters
+// Up to max_scans scans are read. Their timestamps are spread over the time
+// since the previous batch, and the outputs follow the last filtered value.
+// Returns the number of scans, or -1 once the device went away.
+int read_capture(Sensor* sensor, int max_scans) {
+  BufferCapture* capture = &sensor->capture;
+  unsigned char scans[MAX_CAPTURE_SCANS * 64];
+  size_t wanted = (size_t)capture->record_size * (size_t)max_scans;
+  if (wanted > sizeof(scans)) {
+    wanted = sizeof(scans) / (size_t)capture->record_size * (size_t)capture->record_size;
+  }
+  ssize_t bytes_read = read(sensor->capture_source.fd, scans, wanted);
+  if (bytes_read == -1) {
+    if (errno == EAGAIN || errno == EINTR) {
+      return 0;
+    }
+    perror("Error reading the sensor buffer");
+    close_sensor(sensor);
+    return -1;
+  }
+  int count = (int)(bytes_read / capture->record_size);
+  if (count == 0) {
+    return 0;
+  }
+  long now = monotonic_ms();
+  long elapsed = now - capture->last_sample_ms;
+  // Consecutive scans are reduced in bursts, the filters see one value each
+  int illumination = sensor->filter.value;
+  int burst[MAX_BURST_SAMPLES];
+  int burst_count = 0;
+  for (int i = 0; i < count; i++) {
+    burst[burst_count++] = decode_scan_value(scans + i * capture->record_size + capture->offset, &capture->type);
+    if (burst_count < sensor->config->burst_samples && i < count - 1) {
+      continue;
+    }
+    int raw_illumination = burst[0];
+    if (burst_count > 1) {
+      raw_illumination = reduce_burst(burst, burst_count, sensor->config->burst_trim_percent, &sensor->burst_variance);
+    }
+    burst_count = 0;
+    long sample_ms = capture->last_sample_ms + elapsed * (i + 1) / count;
+    // The range is not switched while scans are buffered, they would mix scales
+    int value = scale_sample(&sensor->range, raw_illumination);
+    illumination = filter_apply(&sensor->filter, &sensor->config->filter, value, sample_ms);
+    sensor->samples++;
+  }
+  capture->last_sample_ms = now;
+  for (int i = 0; i < sensor->output_count; i++) {
+    apply_ambient_brightness(sensor->outputs[i], illumination);
+  }
+  return count;
+}
+
+// Handler for scans arriving in the IIO buffer of a sensor
+void handle_sensor_capture(void* data, uint32_t events) {
+  Sensor* sensor = data;
+  (void)events;
+  while (sensor->capture.active && read_capture(sensor, MAX_CAPTURE_SCANS) == MAX_CAPTURE_SCANS) {
+  }
+}
+
+// Handler for threshold events of a sensor
+// The light left the band, so the sensor is polled again until it settles
+void handle_sensor_event(void* data, uint32_t events) {
+  Sensor* sensor = data;
+  struct iio_event_data event_data[16];
+  bool received = false;
+  (void)events;
+  while (read(sensor->event_source.fd, event_data, sizeof(event_data)) > 0) {
+    received = true;
+  }
+  if (!received || !sensor->events.armed || !ambient_active(sensor->daemon)) {
+    return;
+  }
+  set_events_enabled(sensor, false);
+  sampler_reset(&sensor->sampler, sensor->daemon->config);
+  arm_sensor_timer(sensor, 0);
+}
+
+// Function to compare the cached brightness of an output with the device
+// A difference can only come from another program, as every write of the
+// daemon updates the cache. Ambient mode then follows the output policy.
+void reconcile_output(Output* output) {
+  Backlight* backlight = &output->backlight;
+  int value;
+  if (!output->available || read_requested_brightness(backlight, &value) == -1 || value == backlight->current_brightness) {
+    return;
+  }
+  transition_stop(&output->transition);
+  backlight->current_brightness = value;
+  backlight->external_changes++;
+  syslog(LOG_INFO, "output %s changed externally to %d", output->config->name, value);
+  if (output->config->external_change == EXTERNAL_PAUSE) {
+    output->paused = true;
+  } else if (output->config->external_change == EXTERNAL_REBASE && output->ambient_value >= 0) {
+    output->ambient_offset = value - output->ambient_value;
+  }
+}
+
+// Function to adjust every output that takes manual adjustments
+void adjust_outputs(Daemon* daemon, int value) {
+  for (int i = 0; i < daemon->output_count; i++) {
+    Output* output = &daemon->outputs[i];
+    if (!output->available || !output->config->manual) {
+      continue;
+    }
+    // The reconcile timer stops outside ambient mode, catch up on outputs
+    // that cannot notify before adjusting from the cached brightness
+    if (output->change_source.fd == -1) {
+      reconcile_output(output);
+    }
+    // Adjust relative to the running fade, so repeated presses accumulate
+    Transition* transition = &output->transition;
+    if (transition->active) {
+      transition_start(transition, transition->target_value + (int)((output->backlight.max_brightness / 100.0) * value));
+    } else {
+      int brightness = adjusted_brightness(value, &output->backlight);
+      if (brightness != -1) {
+        transition_start(transition, brightness);
+      }
+    }
+  }
+}
+
+// Handler for expirations of a sensor sampling timer
+void handle_sensor_timer(void* data, uint32_t events) {
+  Sensor* sensor = data;
+  (void)events;
+  uint64_t expirations;
+  if (read(sensor->timer.fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    return;
+  }
+  if (!ambient_active(sensor->daemon)) {
+    return;
+  }
+  if (sensor->capture.active) {
+    // Test mode, replay one watermark worth of scans per interval. A device
+    // buffer wakes the daemon by itself, so its timer is not armed again.
+    if (read_capture(sensor, sensor->config->buffer_watermark) != -1 && sensor->capture.from_file) {
+      arm_sensor_timer(sensor, sensor->daemon->config->sample_interval_min_ms);
+    }
+  } else {
+    unsigned long samples = sensor->samples;
+    int next_sample_ms = update_ambient_brightness(sensor, 1);
+    // A failed read also returns the slowest interval, but there is no
+    // reading to put the band around, so the timer keeps running then
+    bool fresh = sensor->samples != samples;
+    if (sensor->events.active && fresh && next_sample_ms >= sensor->daemon->config->sample_interval_max_ms) {
+      // The light settled, sleep until it leaves the band around this reading
+      arm_events(sensor, sensor->range.raw_value);
+    } else {
+      arm_sensor_timer(sensor, next_sample_ms);
+    }
+  }
+}
+
+// Function to take a fresh reading of a sensor after a resume
+// The filter history and sampling rate are from before the suspend, so they
+// are dropped. A burst replaces the first reading and the outputs move with
+// a fast transition.
+void resample_sensor(Sensor* sensor) {
+  const ConfigData* config = sensor->daemon->config;
+  sampler_reset(&sensor->sampler, config);
+  filter_reset(&sensor->filter);
+  if (sensor->events.armed) {
+    set_events_enabled(sensor, false);
+  }
+  // Drivers refuse direct reads while the buffer is enabled, so the burst is
+  // taken with the buffer off. Restarting the capture afterwards drops the
+  // scans buffered before the suspend.
+  set_capture_enabled(sensor, false);
+  for (int i = 0; i < sensor->output_count; i++) {
+    sensor->outputs[i]->transition.fast = true;
+  }
+  int next_sample_ms = update_ambient_brightness(sensor, config->resume_burst_samples);
+  for (int i = 0; i < sensor->output_count; i++) {
+    sensor->outputs[i]->transition.fast = false;
+  }
+  if (next_sample_ms == -1) {
+    return;
+  }
+  set_capture_enabled(sensor, true);
+  if (!sensor->capture.active || sensor->capture.from_file) {
+    arm_sensor_timer(sensor, next_sample_ms);
+  }
+}
+
+#define RESUME_THRESHOLD_NS 100000000LL
+
+// Function to get the time the system spent suspended since boot
+// CLOCK_BOOTTIME keeps counting during suspend, CLOCK_MONOTONIC does not.
+// The two clocks are read one after the other, so the result jitters by the
+// time between the reads.
+int64_t suspended_ns() {
+  struct timespec boottime;
+  struct timespec monotonic;
+  clock_gettime(CLOCK_MONOTONIC, &monotonic);
+  clock_gettime(CLOCK_BOOTTIME, &boottime);
+  return (int64_t)(boottime.tv_sec - monotonic.tv_sec) * 1000000000LL + (boottime.tv_nsec - monotonic.tv_nsec);
+}
+
+// Function to check if the system was suspended since the last wakeup
+// Sensors with outputs are resampled right away instead of after the
+// interval that was running when the system went to sleep. Growth up to
+// RESUME_THRESHOLD_NS is jitter of the clock reads, not a suspend.
+void check_resume(Daemon* daemon) {
+  int64_t suspended = suspended_ns();
+  int64_t slept_ns = suspended - daemon->suspended_ns;
+  if (slept_ns <= RESUME_THRESHOLD_NS) {
+    return;
+  }
+  daemon->suspended_ns = suspended;
+  daemon->resumes++;
+  syslog(LOG_INFO, "resumed after %ld ms suspended", (long)(slept_ns / 1000000));
+  if (!ambient_active(daemon)) {
+    return;
+  }
+  for (int i = 0; i < daemon->sensor_count; i++) {
+    Sensor* sensor = &daemon->sensors[i];
+    if (sensor->available && sensor->output_count > 0) {
+      resample_sensor(sensor);
+    }
+  }
+}
+
+// Function to arm the wall clock watch
+// The timer never expires in practice, it is cancelled whenever the realtime
+// clock is set, which the kernel also does on resume
+int arm_clock_watch(Daemon* daemon) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  clock_gettime(CLOCK_REALTIME, &spec.it_value);
+  spec.it_value.tv_sec += 365L * 24 * 3600;
+  return timerfd_settime(daemon->clock.fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, NULL);
+}
+
+// Handler for jumps of the wall clock
+// A read fails with ECANCELED after the clock was set, the watch is armed again.
+// The event loop already ran check_resume for this wakeup, so a jump without
+// a new resume was a change of the wall clock only.
+void handle_clock_change(void* data, uint32_t events) {
+  Daemon* daemon = data;
+  uint64_t expirations;
+  (void)events;
+  if (read(daemon->clock.fd, &expirations, sizeof(expirations)) == -1 && errno == EAGAIN) {
+    return;
+  }
+  if (arm_clock_watch(daemon) == -1) {
+    perror("Error arming the clock watch");
+  }
+  if (daemon->resumes == daemon->clock_resumes) {
+    syslog(LOG_INFO, "wall clock changed");
+  }
+  daemon->clock_resumes = daemon->resumes;
+}
+
+// Function to compute the average number of event loop wakeups per hour
+unsigned long wakeups_per_hour(const Daemon* daemon) {
+  long uptime_ms = monotonic_ms() - daemon->started_ms;
+  if (uptime_ms <= 0) {
+    return 0;
+  }
+  return (unsigned long)((double)daemon->wakeups * 3600000.0 / uptime_ms);
+}
+
+// Function to write the daemon statistics to the system log
+void log_statistics(const Daemon* daemon) {
+  syslog(LOG_INFO, "ambient mode %s, wakeups %lu (%lu per hour), dropped events %lu, resumes %lu",
+         daemon->ambient_mode ? "on" : "off", daemon->wakeups, wakeups_per_hour(daemon), daemon->dropped_events,
+         daemon->resumes);
+  for (int i = 0; i < daemon->output_count; i++) {
+    const Output* output = &daemon->outputs[i];
+    syslog(LOG_INFO, "output %s: brightness %d/%d, writes %lu, suppressed writes %lu, external changes %lu",
+           output->config->name, output->backlight.current_brightness, output->backlight.max_brightness,
+           output->backlight.writes, output->backlight.suppressed_writes, output->backlight.external_changes);
+  }
+  for (int i = 0; i < daemon->sensor_count; i++) {
+    const Sensor* sensor = &daemon->sensors[i];
+    syslog(LOG_INFO, "sensor %s: samples %lu, sample interval %d ms, raw %d, filtered %d, rejected spikes %lu, outliers %lu, burst variance %u",
+           sensor->config->name, sensor->samples, sensor->sampler.interval_ms,
+           sensor->filter.raw_value, sensor->filter.value, sensor->filter.rejected_spikes, sensor->outliers,
+           sensor->burst_variance);
+  }
+}
+
+// Handler for signals delivered through the signalfd
+void handle_signals(void* data, uint32_t events) {
+  Daemon* daemon = data;
+  (void)events;
+  struct signalfd_siginfo info;
+  while (read(daemon->signals.fd, &info, sizeof(info)) == sizeof(info)) {
+    if (info.ssi_signo == SIGTERM || info.ssi_signo == SIGINT) {
+      daemon->running = false;
+    } else if (info.ssi_signo == SIGUSR1) {
+      log_statistics(daemon);
+    }
+  }
+}
+
+// Handler for change notifications of a backlight
+// Reading the attribute again acknowledges the notification
+void handle_brightness_change(void* data, uint32_t events) {
+  Output* output = data;
+  int value;
+  (void)events;
+  SysfsAttribute* attribute = (output->backlight.hw_changed.fd != -1)
+    ? &output->backlight.hw_changed : &output->backlight.actual_brightness;
+  attribute_read_int(attribute, &value);
+  reconcile_output(output);
+}
+
+// Function to watch a backlight for changes by other programs
+// LEDs notify on brightness_hw_changed, backlights on actual_brightness. Any
+// sysfs attribute can be polled, but the kernel only notifies these two, so
+// LEDs without brightness_hw_changed and attributes that cannot be polled at
+// all, e.g. regular files, are covered by the periodic reconcile timer instead.
+void watch_output(Output* output) {
+  Backlight* backlight = &output->backlight;
+  output->change_source = (EventSource){ -1, handle_brightness_change, output };
+  if (backlight->hw_changed.fd == -1 && backlight->led) {
+    return;
+  }
+  SysfsAttribute* attribute = (backlight->hw_changed.fd != -1) ? &backlight->hw_changed : &backlight->actual_brightness;
+  int fd = attribute->fd;
+  int value;
+  attribute_read_int(attribute, &value);
+  struct epoll_event event;
+  event.events = EPOLLPRI;
+  event.data.ptr = &output->change_source;
+  if (epoll_ctl(output->daemon->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0) {
+    output->change_source.fd = fd;
+  }
+}
+
+// Function to open the power state attributes of an output
+// Missing attributes are left closed and do not count
+void open_display_power(DisplayPower* power, const OutputConfig* config) {
+  power->dpms.fd = -1;
+  power->enabled.fd = -1;
+  attribute_open(&power->bl_power, config->path, "bl_power", O_RDONLY);
+  if (config->display_connector[0] != '\0') {
+    attribute_open(&power->dpms, config->display_connector, "dpms", O_RDONLY);
+    attribute_open(&power->enabled, config->display_connector, "enabled", O_RDONLY);
+  }
+}
+
+// Function to close the power state attributes of an output
+void close_display_power(DisplayPower* power) {
+  attribute_close(&power->bl_power);
+  attribute_close(&power->dpms);
+  attribute_close(&power->enabled);
+}
+
+// Check if an output can tell whether its display is on
+bool has_display_power(const DisplayPower* power) {
+  return power->bl_power.fd != -1 || power->dpms.fd != -1 || power->enabled.fd != -1;
+}
+
+// Function to read if the display of an output is on
+// bl_power is FB_BLANK_UNBLANK (0) while the panel is lit. Unreadable
+// attributes count as on, so a broken probe never stops ambient mode.
+bool read_display_power(DisplayPower* power) {
+  int blank;
+  char state[32];
+  if (power->bl_power.fd != -1 && attribute_read_int(&power->bl_power, &blank) == 0 && blank != 0) {
+    return false;
+  }
+  if (power->dpms.fd != -1 && attribute_read_string(&power->dpms, state, sizeof(state)) == 0 && strcmp(state, "On") != 0) {
+    return false;
+  }
+  if (power->enabled.fd != -1 && attribute_read_string(&power->enabled, state, sizeof(state)) == 0 &&
+      strcmp(state, "disabled") == 0) {
+    return false;
+  }
+  return true;
+}
+
+// Function to open the devices of an output and compile its curve
+int open_output(Output* output) {
+  const OutputConfig* config = output->config;
+  if (open_backlight(&output->backlight, config->path) == -1) {
+    output->available = false;
+    return -1;
+  }
+  int max_brightness = output->backlight.max_brightness;
+  output->min_value = (int)((max_brightness / 100.0) * config->min_brightness);
+  output->max_value = (int)((max_brightness / 100.0) * config->max_brightness);
+  compile_curve(&output->curve, config, max_brightness);
+  output->paused = false;
+  output->ambient_value = -1;
+  output->ambient_offset = 0;
+  watch_output(output);
+  open_display_power(&output->power, config);
+  output->available = true;
+  return 0;
+}
+
+// Function to close the devices of an output
+// Closing the watched attribute also removes it from the event loop
+void close_output(Output* output) {
+  if (output->available) {
+    transition_stop(&output->transition);
+    close_backlight(&output->backlight);
+    close_display_power(&output->power);
+    output->change_source.fd = -1;
+    output->available = false;
+  }
+}
+
+// Check if an output cannot notify changes and is driven by the daemon
+// Outputs that are neither manual nor fed by a sensor are never written, so
+// there is no cache to keep in step with them
+bool is_polled_output(const Output* output) {
+  return output->available && output->change_source.fd == -1 &&
+         (output->config->manual || output->sensor_index != -1);
+}
+
+// Handler for the periodic reconcile of outputs that cannot notify
+void handle_reconcile_timer(void* data, uint32_t events) {
+  Daemon* daemon = data;
+  uint64_t expirations;
+  (void)events;
+  if (read(daemon->reconcile.fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    return;
+  }
+  for (int i = 0; i < daemon->output_count; i++) {
+    if (is_polled_output(&daemon->outputs[i])) {
+      reconcile_output(&daemon->outputs[i]);
+    }
+  }
+}
+
+// Function to run the reconcile timer only while ambient mode is active and
+// an output has to be polled, so an idle daemon sleeps without any timer
+void arm_reconcile_timer(Daemon* daemon) {
+  bool polled = false;
+  for (int i = 0; i < daemon->output_count; i++) {
+    if (is_polled_output(&daemon->outputs[i])) {
+      polled = true;
+    }
+  }
+  int interval_ms = (polled && ambient_active(daemon)) ? daemon->config->reconcile_interval_ms : 0;
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (interval_ms > 0) {
+    spec.it_value.tv_sec = interval_ms / 1000;
+    spec.it_value.tv_nsec = (interval_ms % 1000) * 1000000L;
+    spec.it_interval = spec.it_value;
+  }
+  if (timerfd_settime(daemon->reconcile.fd, 0, &spec, NULL) == -1) {
+    perror("Error arming the reconcile timer");
+  }
+}
+
+// Function to run the display probe only while the display is off in ambient
+// mode and an output reports its power state. While the display is on, the
+// state is checked on the wakeups the daemon has anyway, and with ambient
+// mode off there is nothing to pause.
+void arm_display_probe(Daemon* daemon) {
+  bool known = false;
+  for (int i = 0; i < daemon->output_count; i++) {
+    if (daemon->outputs[i].available && has_display_power(&daemon->outputs[i].power)) {
+      known = true;
+    }
+  }
+  int interval_ms = (known && daemon->ambient_mode && !daemon->display_on) ? daemon->config->display_probe_interval_ms : 0;
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (interval_ms > 0) {
+    spec.it_value.tv_sec = interval_ms / 1000;
+    spec.it_value.tv_nsec = (interval_ms % 1000) * 1000000L;
+    spec.it_interval = spec.it_value;
+  }
+  if (timerfd_settime(daemon->display_probe.fd, 0, &spec, NULL) == -1) {
+    perror("Error arming the display probe");
+  }
+}
+
+// Function to stop or restart ambient mode when the display is switched
+// Sensor timers, buffers and running transitions stop while it is off. When
+// it comes back, sensors are resampled at once like after a resume.
+void set_display_power(Daemon* daemon, bool on) {
+  daemon->display_on = on;
+  syslog(LOG_INFO, "display %s", on ? "on" : "off");
+  if (!on) {
+    set_ambient_timer(daemon, false);
+    for (int i = 0; i < daemon->output_count; i++) {
+      transition_stop(&daemon->outputs[i].transition);
+    }
+  } else if (daemon->ambient_mode) {
+    for (int i = 0; i < daemon->sensor_count; i++) {
+      Sensor* sensor = &daemon->sensors[i];
+      if (sensor->available && sensor->output_count > 0) {
+        resample_sensor(sensor);
+      }
+    }
+  }
+  arm_reconcile_timer(daemon);
+  arm_display_probe(daemon);
+}
+
+// Function to check if the display was switched on or off
+// The display is off once every output that can tell reports it off
+void check_display_power(Daemon* daemon) {
+  bool known = false;
+  bool on = false;
+  for (int i = 0; i < daemon->output_count; i++) {
+    Output* output = &daemon->outputs[i];
+    if (output->available && has_display_power(&output->power)) {
+      known = true;
+      on = on || read_display_power(&output->power);
+    }
+  }
+  if (!known) {
+    on = true;
+  }
+  if (on != daemon->display_on) {
+    set_display_power(daemon, on);
+  }
+}
+
+// Handler for the periodic probe of the display power state
+// bl_power and the connector dpms do not notify, so they are polled slowly
+void handle_display_probe(void* data, uint32_t events) {
+  Daemon* daemon = data;
+  uint64_t expirations;
+  (void)events;
+  if (read(daemon->display_probe.fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+    check_display_power(daemon);
+  }
+}
+
+// Function to check the display power state after any other wakeup
+// Sensor reads, the reconcile and commands look at it at most once per
+// display_probe_interval_ms, so a lit display needs no timer of its own
+void check_display_power_on_wakeup(Daemon* daemon) {
+  if (!daemon->ambient_mode || !daemon->display_on) {
+    return;
+  }
+  long now = monotonic_ms();
+  if (now - daemon->display_checked_ms < daemon->config->display_probe_interval_ms) {
+    return;
+  }
+  daemon->display_checked_ms = now;
+  check_display_power(daemon);
+}
+
+// Function to enable or disable ambient mode
+// Enabling it again drops the pauses and offsets left by external changes
+void set_ambient_mode(Daemon* daemon, bool enabled) {
+  if (daemon->ambient_mode != enabled) {
+    daemon->ambient_mode = enabled;
+    for (int i = 0; enabled && i < daemon->output_count; i++) {
+      daemon->outputs[i].paused = false;
+      daemon->outputs[i].ambient_offset = 0;
+    }
+    if (enabled) {
+      // The probe did not run while ambient mode was off
+      check_display_power(daemon);
+    }
+    set_ambient_timer(daemon, ambient_active(daemon));
+    arm_reconcile_timer(daemon);
+    arm_display_probe(daemon);
+  }
+}
+
+// Function to execute a coalesced command from the pipe or the command ring
+void apply_command(Daemon* daemon, const BmPipeData* command) {
+  if (command->brightness_adjustment != 0) {
+    adjust_outputs(daemon, command->brightness_adjustment);
+  }
+  if (command->ambient_mode) {
+    set_ambient_mode(daemon, !daemon->ambient_mode);
+  }
+}
+
+// Handler for messages arriving on the control pipe
+void handle_control(void* data, uint32_t events) {
+  Daemon* daemon = data;
+  (void)events;
+  BmPipeData command;
+  if (read_fifo(daemon->control.fd, &command)) {
+    apply_command(daemon, &command);
+  }
+}
+
+// Function to register every device under sensor_path as a member of the
+// fused sensors that name no members themselves
+void expand_fusion(ConfigData* config) {
+  int count = config->sensor_count;
+  for (int i = 0; i < count; i++) {
+    SensorConfig* fused = &config->sensors[i];
+    if (fused->fusion == FUSION_NONE || fused->explicit_path || fused->fusion_sensors[0] != '\0') {
+      continue;
+    }
+    DIR* dir = opendir(fused->sensor_path);
+    if (dir == NULL) {
+      perror("Error opening iio devices directory");
+      continue;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+      char directory[sizeof(fused->sensor_file_path)];
+      char path[MAX_PATH_LENGTH];
+      if (entry->d_name[0] == '.' ||
+          snprintf(directory, sizeof(directory), "%s/%s", fused->sensor_path, entry->d_name) >= (int)sizeof(directory) ||
+          snprintf(path, sizeof(path), "%s/%s", directory, fused->sensor_file) >= (int)sizeof(path) ||
+          access(path, R_OK) == -1) {
+        continue;
+      }
+      // Keep the member name short enough for the status page
+      const char* device = entry->d_name;
+      if (strncmp(device, "iio:", 4) == 0) {
+        device += 4;
+      }
+      char name[MAX_NAME_LENGTH];
+      snprintf(name, sizeof(name), "%.7s:%.16s", fused->name, device);
+      SensorConfig* member = add_sensor_config(config, name);
+      if (member == NULL) {
+        break;
+      }
+      *member = *fused;
+      strncpy(member->name, name, sizeof(member->name) - 1);
+      memcpy(member->sensor_file_path, directory, sizeof(member->sensor_file_path));
+      member->explicit_path = true;
+      member->fusion = FUSION_NONE;
+      member->capture = CAPTURE_SYSFS;
+      size_t length = strlen(fused->fusion_sensors);
+      snprintf(fused->fusion_sensors + length, sizeof(fused->fusion_sensors) - length, "%s%s", (length > 0) ? "," : "", name);
+    }
+    closedir(dir);
+  }
+}
+
+// Function to link fused sensors to their members
+void link_fusion(Daemon* daemon) {
+  for (int i = 0; i < daemon->sensor_count; i++) {
+    Sensor* sensor = &daemon->sensors[i];
+    const SensorConfig* config = sensor->config;
+    if (config->fusion == FUSION_NONE || config->explicit_path) {
+      continue;
+    }
+    char list[sizeof(config->fusion_sensors)];
+    memcpy(list, config->fusion_sensors, sizeof(list));
+    char* save = NULL;
+    for (char* name = strtok_r(list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+      int index = find_sensor_config(daemon->config, name);
+      if (index == -1 || index == i || daemon->config->sensors[index].fusion != FUSION_NONE) {
+        fprintf(stderr, "Sensor %s cannot fuse %s\n", config->name, name);
+        continue;
+      }
+      sensor->members[sensor->member_count++] = &daemon->sensors[index];
+    }
+  }
+}
+
+// Function to build the device registry from the configuration
+// Outputs are linked to the sensor they follow, each sensor gets its own timer
+void open_registry(Daemon* daemon) {
+  ConfigData* config = daemon->config;
+  expand_fusion(config);
+  daemon->sensor_count = config->sensor_count;
+  for (int i = 0; i < config->sensor_count; i++) {
+    Sensor* sensor = &daemon->sensors[i];
+    sensor->config = &config->sensors[i];
+    sensor->daemon = daemon;
+    strncpy(sensor->device_path, sensor->config->sensor_file_path, sizeof(sensor->device_path) - 1);
+    sensor->timer = (EventSource){ timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), handle_sensor_timer, sensor };
+    sensor->capture_source = (EventSource){ -1, handle_sensor_capture, sensor };
+    sensor->event_source = (EventSource){ -1, handle_sensor_event, sensor };
+    if (sensor->timer.fd == -1 || add_event_source(daemon->epoll_fd, &sensor->timer, EPOLLIN) == -1) {
+      perror("Error creating the sensor timer");
+      exit(EXIT_FAILURE);
+    }
+    open_sensor(sensor);
+  }
+  link_fusion(daemon);
+  daemon->output_count = config->output_count;
+  for (int i = 0; i < config->output_count; i++) {
+    Output* output = &daemon->outputs[i];
+    output->config = &config->outputs[i];
+    output->transition.timer = (EventSource){ timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), handle_transition_timer, &output->transition };
+    output->transition.backlight = &output->backlight;
+    output->transition.config = output->config;
+    output->daemon = daemon;
+    if (output->transition.timer.fd == -1 || add_event_source(daemon->epoll_fd, &output->transition.timer, EPOLLIN) == -1) {
+      perror("Error creating the transition timer");
+      exit(EXIT_FAILURE);
+    }
+    open_output(output);
+    output->sensor_index = find_sensor_config(config, output->config->sensor);
+    if (output->sensor_index != -1) {
+      Sensor* sensor = &daemon->sensors[output->sensor_index];
+      sensor->outputs[sensor->output_count++] = output;
+    }
+  }
+}
+
+// Function to close every device of the registry
+void close_registry(Daemon* daemon) {
+  for (int i = 0; i < daemon->output_count; i++) {
+    close_output(&daemon->outputs[i]);
+    close(daemon->outputs[i].transition.timer.fd);
+  }
+  for (int i = 0; i < daemon->sensor_count; i++) {
+    close_sensor(&daemon->sensors[i]);
+    close(daemon->sensors[i].timer.fd);
+  }
+}
+
+// Function to get the last component of a path
+const char* path_basename(const char* path) {
+  const char* slash = strrchr(path, '/');
+  return (slash != NULL) ? slash + 1 : path;
+}
+
+// Check if a configured device path and a hotplug device path name the same device
+// Class links and the devices tree share the device name, so the last path
+// components are compared
+bool same_device(const char* path, const char* devpath) {
+  return path[0] != '\0' && strcmp(path_basename(path), path_basename(devpath)) == 0;
+}
+
+// Function to open the kernel uevent netlink socket
+int netlink_open(HotplugMonitor* monitor, const ConfigData* config) {
+  (void)config;
+  int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+  if (fd == -1) {
+    perror("Error opening the uevent socket");
+    return -1;
+  }
+  struct sockaddr_nl address;
+  memset(&address, 0, sizeof(address));
+  address.nl_family = AF_NETLINK;
+  address.nl_groups = 1; // Kernel events
+  if (bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+    perror("Error binding the uevent socket");
+    close(fd);
+    return -1;
+  }
+  monitor->source.fd = fd;
+  return 0;
+}
+
+// Function to read one kernel uevent
+// The message is a list of NUL separated KEY=value strings after an action@devpath header
+int netlink_next_event(HotplugMonitor* monitor, HotplugEvent* event) {
+  struct sockaddr_nl sender;
+  struct iovec iov = { monitor->buffer, sizeof(monitor->buffer) - 1 };
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_name = &sender;
+  message.msg_namelen = sizeof(sender);
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  ssize_t length = recvmsg(monitor->source.fd, &message, 0);
+  if (length <= 0) {
+    return -1;
+  }
+  // Only trust messages sent by the kernel itself
+  if (sender.nl_pid != 0) {
+    return 0;
+  }
+  monitor->buffer[length] = '\0';
+  memset(event, 0, sizeof(*event));
+  event->action = -1;
+  for (ssize_t offset = 0; offset < length; offset += (ssize_t)strlen(monitor->buffer + offset) + 1) {
+    const char* field = monitor->buffer + offset;
+    if (strcmp(field, "ACTION=add") == 0) {
+      event->action = HOTPLUG_ADD;
+    } else if (strcmp(field, "ACTION=remove") == 0) {
+      event->action = HOTPLUG_REMOVE;
+    } else if (strcmp(field, "ACTION=change") == 0) {
+      event->action = HOTPLUG_CHANGE;
+    } else if (strncmp(field, "DEVPATH=", 8) == 0) {
+      strncpy(event->devpath, field + 8, sizeof(event->devpath) - 1);
+    } else if (strncmp(field, "SUBSYSTEM=", 10) == 0) {
+      strncpy(event->subsystem, field + 10, sizeof(event->subsystem) - 1);
+    }
+  }
+  if (event->action == -1 || event->devpath[0] == '\0') {
+    return 0;
+  }
+  return 1;
+}
+
+// Function to add a directory to the inotify watch list once
+void inotify_add_directory(HotplugMonitor* monitor, const char* directory) {
+  if (directory[0] == '\0' || monitor->directory_count == MAX_HOTPLUG_DIRECTORIES) {
+    return;
+  }
+  for (int i = 0; i < monitor->directory_count; i++) {
+    if (strcmp(monitor->directories[i], directory) == 0) {
+      return;
+    }
+  }
+  int watch = inotify_add_watch(monitor->source.fd, directory, IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM);
+  if (watch == -1) {
+    fprintf(stderr, "Error watching %s: %s\n", directory, strerror(errno));
+    return;
+  }
+  monitor->watches[monitor->directory_count] = watch;
+  strncpy(monitor->directories[monitor->directory_count], directory, sizeof(monitor->directories[0]) - 1);
+  monitor->directory_count++;
+}
+
+// Function to watch device directories with inotify
+// sysfs does not support inotify, this backend exists to drive the daemon
+// against a fake device tree. Devices should be moved into place once complete.
+int inotify_open(HotplugMonitor* monitor, const ConfigData* config) {
+  monitor->source.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (monitor->source.fd == -1) {
+    perror("Error opening inotify");
+    return -1;
+  }
+  char directories[256];
+  strncpy(directories, config->hotplug_directories, sizeof(directories) - 1);
+  directories[sizeof(directories) - 1] = '\0';
+  char* saveptr;
+  for (char* directory = strtok_r(directories, ",", &saveptr); directory != NULL; directory = strtok_r(NULL, ",", &saveptr)) {
+    inotify_add_directory(monitor, directory);
+  }
+  if (config->hotplug_directories[0] == '\0') {
+    // Watch the parent directories of the configured devices
+    char directory[MAX_PATH_LENGTH];
+    for (int i = 0; i < config->output_count; i++) {
+      strncpy(directory, config->outputs[i].path, sizeof(directory) - 1);
+      directory[sizeof(directory) - 1] = '\0';
+      char* slash = strrchr(directory, '/');
+      if (slash != NULL) {
+        *slash = '\0';
+        inotify_add_directory(monitor, directory);
+      }
+    }
+    for (int i = 0; i < config->sensor_count; i++) {
+      inotify_add_directory(monitor, config->sensors[i].sensor_path);
+    }
+  }
+  return 0;
+}
+
+// Function to get the next inotify event, reading a new batch when needed
+int inotify_next_event(HotplugMonitor* monitor, HotplugEvent* event) {
+  if (monitor->offset >= monitor->length) {
+    ssize_t length = read(monitor->source.fd, monitor->buffer, sizeof(monitor->buffer));
+    if (length <= 0) {
+      return -1;
+    }
+    monitor->length = (size_t)length;
+    monitor->offset = 0;
+  }
+  const struct inotify_event* notification = (const struct inotify_event*)(monitor->buffer + monitor->offset);
+  monitor->offset += sizeof(struct inotify_event) + notification->len;
+  if (notification->len == 0) {
+    return 0;
+  }
+  const char* directory = NULL;
+  for (int i = 0; i < monitor->directory_count; i++) {
+    if (monitor->watches[i] == notification->wd) {
+      directory = monitor->directories[i];
+    }
+  }
+  if (directory == NULL) {
+    return 0;
+  }
+  memset(event, 0, sizeof(*event));
+  event->action = (notification->mask & (IN_CREATE | IN_MOVED_TO)) ? HOTPLUG_ADD : HOTPLUG_REMOVE;
+  snprintf(event->devpath, sizeof(event->devpath), "%s/%s", directory, notification->name);
+  return 1;
+}
+
+static const HotplugBackend netlink_backend = { "netlink", netlink_open, netlink_next_event };
+static const HotplugBackend inotify_backend = { "inotify", inotify_open, inotify_next_event };
+
+// Function to update the device registry for one device change
+void hotplug_apply(Daemon* daemon, const HotplugEvent* event) {
+  if (event->action == HOTPLUG_CHANGE) {
+    // Connector and backlight changes may have switched the display
+    if (strcmp(event->subsystem, "drm") == 0 || strcmp(event->subsystem, "backlight") == 0) {
+      check_display_power(daemon);
+    }
+    return;
+  }
+  for (int i = 0; i < daemon->output_count; i++) {
+    Output* output = &daemon->outputs[i];
+    if (!same_device(output->config->path, event->devpath)) {
+      continue;
+    }
+    if (event->action == HOTPLUG_REMOVE && output->available) {
+      close_output(output);
+      syslog(LOG_INFO, "output %s removed", output->config->name);
+    } else if (event->action == HOTPLUG_ADD && !output->available && open_output(output) == 0) {
+      syslog(LOG_INFO, "output %s added", output->config->name);
+      // Bring the new output to the ambient brightness right away
+      Sensor* sensor = (output->sensor_index != -1) ? &daemon->sensors[output->sensor_index] : NULL;
+      if (ambient_active(daemon) && sensor != NULL && sensor->available) {
+        if (sensor->capture.active && !sensor->capture.from_file) {
+          // A buffered sensor is not polled, it already holds the filtered light
+          if (sensor->samples > 0) {
+            apply_ambient_brightness(output, sensor->filter.value);
+          }
+        } else {
+          arm_sensor_timer(sensor, 0);
+        }
+      }
+    }
+  }
+  arm_reconcile_timer(daemon);
+  arm_display_probe(daemon);
+  for (int i = 0; i < daemon->sensor_count; i++) {
+    Sensor* sensor = &daemon->sensors[i];
+    if (sensor->member_count > 0) {
+      continue;
+    }
+    if (event->action == HOTPLUG_REMOVE) {
+      if (sensor->available && same_device(sensor->device_path, event->devpath)) {
+        close_sensor(sensor);
+        syslog(LOG_INFO, "sensor %s removed", sensor->config->name);
+      }
+      continue;
+    }
+    if (sensor->available) {
+      continue;
+    }
+    // Sensors found by scanning may come back under a different device name
+    bool candidate = sensor->config->explicit_path
+      ? same_device(sensor->config->sensor_file_path, event->devpath)
+      : (event->subsystem[0] == '\0' || strcmp(event->subsystem, "iio") == 0);
+    if (candidate && open_sensor(sensor) == 0) {
+      syslog(LOG_INFO, "sensor %s added", sensor->config->name);
+      if (ambient_active(daemon) && sensor->output_count > 0) {
+        start_sensor(sensor);
+      }
+    }
+  }
+}
+
+// Handler for readiness of the hotplug monitor
+void handle_hotplug(void* data, uint32_t events) {
+  HotplugMonitor* monitor = data;
+  (void)events;
+  HotplugEvent event;
+  int result;
+  while ((result = monitor->backend->next_event(monitor, &event)) != -1) {
+    if (result == 1) {
+      hotplug_apply(monitor->daemon, &event);
+    }
+  }
+}
+
+// Function to start the configured hotplug backend
+void open_hotplug(Daemon* daemon) {
+  HotplugMonitor* monitor = &daemon->hotplug;
+  monitor->daemon = daemon;
+  monitor->source = (EventSource){ -1, handle_hotplug, monitor };
+  if (daemon->config->hotplug_backend == HOTPLUG_NETLINK) {
+    monitor->backend = &netlink_backend;
+  } else if (daemon->config->hotplug_backend == HOTPLUG_INOTIFY) {
+    monitor->backend = &inotify_backend;
+  } else {
+    return;
+  }
+  if (monitor->backend->open(monitor, daemon->config) == -1 ||
+      add_event_source(daemon->epoll_fd, &monitor->source, EPOLLIN) == -1) {
+    fprintf(stderr, "Hotplug monitor %s not available\n", monitor->backend->name);
+    if (monitor->source.fd != -1) {
+      close(monitor->source.fd);
+      monitor->source.fd = -1;
+    }
+  }
+}
+
+// Function to check whether an evdev device has brightness keys
+bool has_brightness_keys(int fd) {
+  unsigned long bits[KEY_MAX / (8 * sizeof(unsigned long)) + 1];
+  memset(bits, 0, sizeof(bits));
+  if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(bits)), bits) == -1) {
+    return false;
+  }
+  size_t width = 8 * sizeof(unsigned long);
+  return (bits[KEY_BRIGHTNESSUP / width] >> (KEY_BRIGHTNESSUP % width)) & 1 &&
+         (bits[KEY_BRIGHTNESSDOWN / width] >> (KEY_BRIGHTNESSDOWN % width)) & 1;
+}
+
+// Function to stop reading an input device
+void close_input(InputDevice* input) {
+  if (input->source.fd != -1) {
+    epoll_ctl(input->daemon->epoll_fd, EPOLL_CTL_DEL, input->source.fd, NULL);
+    close(input->source.fd);
+    input->source.fd = -1;
+  }
+}
+
+// Handler for key events of an input device
+// All events already queued are handled at once, so a burst of repeats
+// becomes a single fade
+void handle_input(void* data, uint32_t events) {
+  InputDevice* input = data;
+  const ConfigData* config = input->daemon->config;
+  struct input_event key_events[MAX_INPUT_EVENTS];
+  int adjustment = 0;
+  int toggles = 0;
+  (void)events;
+  for (;;) {
+    ssize_t bytes_read = read(input->source.fd, key_events, sizeof(key_events));
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read == -1 && errno == EAGAIN) {
+      break;
+    }
+    if (bytes_read <= 0) {
+      // The device went away
+      fprintf(stderr, "Input device %s closed\n", input->path);
+      close_input(input);
+      break;
+    }
+    size_t count = (size_t)bytes_read / sizeof(struct input_event);
+    for (size_t i = 0; i < count; i++) {
+      const struct input_event* event = &key_events[i];
+      if (event->type != EV_KEY || event->value == 0) {
+        continue;
+      }
+      if (event->code == KEY_BRIGHTNESSUP || event->code == KEY_BRIGHTNESSDOWN) {
+        if (event->value == 1) {
+          input->step = config->input_step;
+        } else {
+          // Key repeat, accelerate up to the maximum step
+          int step = input->step * config->input_repeat_growth_percent / 100;
+          input->step = (step == input->step && config->input_repeat_growth_percent > 100) ? step + 1 : step;
+          if (input->step > config->input_step_max) {
+            input->step = config->input_step_max;
+          }
+        }
+        adjustment += (event->code == KEY_BRIGHTNESSUP) ? input->step : -input->step;
+      } else if (event->code == KEY_BRIGHTNESS_AUTO && event->value == 1) {
+        toggles++;
+      }
+    }
+    if ((size_t)bytes_read < sizeof(key_events)) {
+      break;
+    }
+  }
+  if (adjustment != 0) {
+    adjust_outputs(input->daemon, adjustment);
+  }
+  if (toggles % 2 == 1) {
+    set_ambient_mode(input->daemon, !input->daemon->ambient_mode);
+  }
+}
+
+// Function to start reading an input device
+// Configured paths are used as they are, so a named pipe can stand in for
+// a device, discovered devices must advertise the brightness keys
+int open_input(Daemon* daemon, const char* path, bool discovered) {
+  if (daemon->input_count == MAX_INPUT_DEVICES) {
+    fprintf(stderr, "Too many input devices, ignoring %s\n", path);
+    return -1;
+  }
+  // O_RDWR keeps a named pipe open when its writer goes away
+  struct stat info;
+  int flags = (stat(path, &info) == 0 && S_ISFIFO(info.st_mode)) ? O_RDWR : O_RDONLY;
+  int fd = open(path, flags | O_NONBLOCK | O_CLOEXEC);
+  if (fd == -1) {
+    if (!discovered) {
+      perror("Error opening the input device");
+    }
+    return -1;
+  }
+  if (discovered && !has_brightness_keys(fd)) {
+    close(fd);
+    return -1;
+  }
+  InputDevice* input = &daemon->inputs[daemon->input_count];
+  input->source = (EventSource){ fd, handle_input, input };
+  input->daemon = daemon;
+  input->step = daemon->config->input_step;
+  strncpy(input->path, path, sizeof(input->path) - 1);
+  if (add_event_source(daemon->epoll_fd, &input->source, EPOLLIN) == -1) {
+    close(fd);
+    return -1;
+  }
+  daemon->input_count++;
+  return 0;
+}
+
+// Function to open the input devices of input_devices
+// "auto" looks for devices with brightness keys in /dev/input, otherwise
+// the value is a comma separated list of device paths
+void open_inputs(Daemon* daemon) {
+  const char* devices = daemon->config->input_devices;
+  if (devices[0] == '\0' || strcmp(devices, "none") == 0) {
+    return;
+  }
+  if (strcmp(devices, "auto") == 0) {
+    DIR* dir = opendir(INPUT_DEVICES_PATH);
+    if (dir == NULL) {
+      perror("Error opening the input devices directory");
+      return;
+    }
+    struct dirent* entry;
+    char path[MAX_PATH_LENGTH];
+    while ((entry = readdir(dir)) != NULL) {
+      if (strncmp(entry->d_name, "event", 5) == 0) {
+        snprintf(path, sizeof(path), "%s/%s", INPUT_DEVICES_PATH, entry->d_name);
+        open_input(daemon, path, true);
+      }
+    }
+    closedir(dir);
+  } else {
+    char list[sizeof(daemon->config->input_devices)];
+    strncpy(list, devices, sizeof(list) - 1);
+    list[sizeof(list) - 1] = '\0';
+    char* save = NULL;
+    for (char* path = strtok_r(list, ",", &save); path != NULL; path = strtok_r(NULL, ",", &save)) {
+      open_input(daemon, path, false);
+    }
+  }
+  if (daemon->input_count == 0) {
+    fprintf(stderr, "No input device with brightness keys found\n");
+  }
+}
+
+// Function to close every input device
+void close_inputs(Daemon* daemon) {
+  for (int i = 0; i < daemon->input_count; i++) {
+    close_input(&daemon->inputs[i]);
+  }
+  daemon->input_count = 0;
+}
+
+// Function to describe the state of one output
+void fill_output_state(const Output* output, BmOutputState* state) {
+  strncpy(state->name, output->config->name, sizeof(state->name) - 1);
+  state->current = output->available ? output->backlight.current_brightness : -1;
+  state->target = output->available ? transition_target(&output->transition) : -1;
+  state->max = output->available ? output->backlight.max_brightness : -1;
+  state->flags = (output->available ? BM_OUTPUT_FLAG_AVAILABLE : 0) |
+                 (output->config->manual ? BM_OUTPUT_FLAG_MANUAL : 0) |
+                 (output->sensor_index != -1 ? BM_OUTPUT_FLAG_AMBIENT : 0) |
+                 (output->paused ? BM_OUTPUT_FLAG_PAUSED : 0) |
+                 (!output->daemon->display_on ? BM_OUTPUT_FLAG_DISPLAY_OFF : 0);
+}
+
+// Function to fill the state part of a response
+void fill_state(const Daemon* daemon, BmResponse* response) {
+  response->ambient_mode = daemon->ambient_mode;
+  response->output_count = (uint8_t)daemon->output_count;
+  response->sensor_count = (uint8_t)daemon->sensor_count;
+  for (int i = 0; i < daemon->output_count; i++) {
+    fill_output_state(&daemon->outputs[i], &response->outputs[i]);
+  }
+}
+
+// Function to fill the statistics part of a response
+void fill_stats(const Daemon* daemon, BmResponse* response) {
+  response->ambient_mode = daemon->ambient_mode;
+  response->output_count = (uint8_t)daemon->output_count;
+  response->sensor_count = (uint8_t)daemon->sensor_count;
+  response->stats.uptime_ms = (uint64_t)(monotonic_ms() - daemon->started_ms);
+  response->stats.wakeups = daemon->wakeups;
+  response->stats.wakeups_per_hour = wakeups_per_hour(daemon);
+  for (int i = 0; i < daemon->output_count; i++) {
+    response->stats.outputs[i].writes = daemon->outputs[i].backlight.writes;
+    response->stats.outputs[i].suppressed_writes = daemon->outputs[i].backlight.suppressed_writes;
+    response->stats.outputs[i].external_changes = daemon->outputs[i].backlight.external_changes;
+  }
+  for (int i = 0; i < daemon->sensor_count; i++) {
+    const Sensor* sensor = &daemon->sensors[i];
+    BmSensorStats* stats = &response->stats.sensors[i];
+    strncpy(stats->name, sensor->config->name, sizeof(stats->name) - 1);
+    stats->samples = sensor->samples;
+    stats->rejected_spikes = sensor->filter.rejected_spikes;
+    stats->interval_ms = sensor->sampler.interval_ms;
+    stats->raw_value = sensor->filter.raw_value;
+    stats->value = sensor->filter.value;
+    stats->available = sensor->available;
+    stats->burst_variance = sensor->burst_variance;
+  }
+}
+
+// Function to apply a set or adjust request to one output
+int apply_output_request(Output* output, const BmRequest* request) {
+  if (!output->available) {
+    return -ENODEV;
+  }
+  Backlight* backlight = &output->backlight;
+  int value = request->value;
+  if (!(request->flags & BM_REQUEST_FLAG_RAW)) {
+    value = (int)((backlight->max_brightness / 100.0) * value);
+  }
+  if (request->type == BM_REQUEST_SET) {
+    transition_start(&output->transition, value);
+  } else {
+    // Like adjust_outputs, start from the device if it cannot notify changes
+    if (output->change_source.fd == -1) {
+      reconcile_output(output);
+    }
+    int current = transition_target(&output->transition);
+    if (current < 0 && attribute_read_int(&backlight->actual_brightness, &current) == -1) {
+      return -EIO;
+    }
+    transition_start(&output->transition, current + value);
+  }
+  return 0;
+}
+
+// Function to execute a request and build its response
+void handle_request(Daemon* daemon, const BmRequest* request, BmResponse* response) {
+  memset(response, 0, sizeof(*response));
+  response->version = BM_PROTOCOL_VERSION;
+  response->type = request->type;
+  response->sequence = request->sequence;
+  if (request->version != BM_PROTOCOL_VERSION) {
+    response->status = -EPROTO;
+    return;
+  }
+  switch (request->type) {
+    case BM_REQUEST_SET:
+    case BM_REQUEST_ADJUST:
+      if (request->output == BM_PROTOCOL_ALL_OUTPUTS) {
+        for (int i = 0; i < daemon->output_count; i++) {
+          if (daemon->outputs[i].config->manual) {
+            apply_output_request(&daemon->outputs[i], request);
+          }
+        }
+      } else if (request->output >= 0 && request->output < daemon->output_count) {
+        response->status = apply_output_request(&daemon->outputs[request->output], request);
+      } else {
+        response->status = -ENODEV;
+      }
+      break;
+    case BM_REQUEST_TOGGLE_AMBIENT:
+      set_ambient_mode(daemon, !daemon->ambient_mode);
+      break;
+    case BM_REQUEST_ENABLE_AMBIENT:
+      set_ambient_mode(daemon, true);
+      break;
+    case BM_REQUEST_DISABLE_AMBIENT:
+      set_ambient_mode(daemon, false);
+      break;
+    case BM_REQUEST_QUERY_STATE:
+    case BM_REQUEST_SUBSCRIBE:
+      // Subscribers start from a snapshot of the current state
+      break;
+    case BM_REQUEST_QUERY_STATS:
+      fill_stats(daemon, response);
+      return;
+    case BM_REQUEST_ATTACH_RING:
+      // The descriptors are attached by handle_client
+      if (daemon->ring == NULL) {
+        response->status = -ENOTSUP;
+      }
+      break;
+    default:
+      response->status = -EINVAL;
+      return;
+  }
+  fill_state(daemon, response);
+}
+
+// Function to close a control socket connection
+void close_client(Client* client) {
+  epoll_ctl(client->daemon->epoll_fd, EPOLL_CTL_DEL, client->source.fd, NULL);
+  close(client->source.fd);
+  client->in_use = false;
+}
+
+// Function to wait for writability of a client only while frames are blocked
+// While a response is blocked no requests are read, so the client is not
+// watched for input either, or pipelined requests would wake the loop forever
+void set_client_write_interest(Client* client, bool enabled) {
+  uint32_t events = client->has_pending_response ? EPOLLOUT : enabled ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  client->waiting_for_write = enabled;
+  if (client->epoll_events == events) {
+    return;
+  }
+  struct epoll_event event;
+  event.events = events;
+  event.data.ptr = &client->source;
+  if (epoll_ctl(client->daemon->epoll_fd, EPOLL_CTL_MOD, client->source.fd, &event) == 0) {
+    client->epoll_events = events;
+  }
+}
+
+// Function to send a frame without blocking
+// Returns 1 when sent, 0 when the socket is full and -1 when the connection failed
+int send_frame(Client* client, const BmResponse* frame) {
+  if (send(client->source.fd, frame, sizeof(*frame), MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(*frame)) {
+    return 1;
+  }
+  return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+}
+
+// Function to send a response together with the command ring and its doorbell
+// Returns 1 when sent, 0 when the socket is full and -1 when the connection failed
+int send_ring_frame(Client* client, const BmResponse* frame) {
+  int fds[2] = { client->daemon->ring_fd, client->daemon->doorbell.fd };
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(fds))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = { (void*)frame, sizeof(*frame) };
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.buffer;
+  message.msg_controllen = sizeof(control.buffer);
+  struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(header), fds, sizeof(fds));
+  if (sendmsg(client->source.fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(*frame)) {
+    return 1;
+  }
+  return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+}
+
+// Function to send the blocked response and queued events until the socket is full
+// Returns -1 if the connection failed
+int flush_client(Client* client) {
+  int result = 1;
+  if (client->has_pending_response) {
+    result = send_frame(client, &client->pending_response);
+    client->has_pending_response = (result == 0);
+  }
+  while (result == 1 && client->queue_count > 0) {
+    const PendingEvent* pending = &client->queue[client->queue_head];
+    BmResponse frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.version = BM_PROTOCOL_VERSION;
+    frame.type = pending->type;
+    frame.ambient_mode = client->daemon->ambient_mode;
+    frame.event = pending->data;
+    result = send_frame(client, &frame);
+    if (result == 1) {
+      client->queue_head = (client->queue_head + 1) % MAX_PENDING_EVENTS;
+      client->queue_count--;
+    }
+  }
+  if (result == -1) {
+    return -1;
+  }
+  set_client_write_interest(client, result == 0);
+  return 0;
+}
+
+// Function to queue an event for a subscriber
+// A queued event for the same output or sensor is replaced by the newer one
+void queue_event(Client* client, uint16_t type, const BmEventData* data) {
+  for (int i = 0; i < client->queue_count; i++) {
+    PendingEvent* pending = &client->queue[(client->queue_head + i) % MAX_PENDING_EVENTS];
+    if (pending->type == type && pending->data.index == data->index) {
+      pending->data = *data;
+      return;
+    }
+  }
+  if (client->queue_count == MAX_PENDING_EVENTS) {
+    client->queue_head = (client->queue_head + 1) % MAX_PENDING_EVENTS;
+    client->queue_count--;
+    client->daemon->dropped_events++;
+  }
+  PendingEvent* pending = &client->queue[(client->queue_head + client->queue_count) % MAX_PENDING_EVENTS];
+  pending->type = type;
+  pending->data = *data;
+  client->queue_count++;
+}
+
+// Function to queue an event for every client subscribed to it
+void broadcast_event(Daemon* daemon, uint32_t mask, uint16_t type, int index, int value, int target, int max) {
+  BmEventData data = { index, value, target, max };
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    Client* client = &daemon->clients[i];
+    if (client->in_use && (client->subscriptions & mask)) {
+      queue_event(client, type, &data);
+    }
+  }
+}
+
+// Function to push state changes since the last loop iteration to subscribers
+// Output events are sent when a fade starts and when it settles, not per frame
+void publish_changes(Daemon* daemon) {
+  for (int i = 0; i < daemon->output_count; i++) {
+    Output* output = &daemon->outputs[i];
+    int current = output->available ? output->backlight.current_brightness : -1;
+    int target = output->available ? transition_target(&output->transition) : -1;
+    if (target != output->published_target || (!output->transition.active && current != output->published_current)) {
+      output->published_current = current;
+      output->published_target = target;
+      broadcast_event(daemon, BM_EVENT_MASK_OUTPUT, BM_EVENT_OUTPUT, i, current, target,
+                      output->available ? output->backlight.max_brightness : -1);
+    }
+  }
+  if (daemon->ambient_mode != daemon->published_ambient_mode) {
+    daemon->published_ambient_mode = daemon->ambient_mode;
+    broadcast_event(daemon, BM_EVENT_MASK_AMBIENT, BM_EVENT_AMBIENT, 0, daemon->ambient_mode, daemon->ambient_mode, 1);
+  }
+  for (int i = 0; i < daemon->sensor_count; i++) {
+    Sensor* sensor = &daemon->sensors[i];
+    if (sensor->filter.value != sensor->published_value) {
+      sensor->published_value = sensor->filter.value;
+      broadcast_event(daemon, BM_EVENT_MASK_SENSOR, BM_EVENT_SENSOR, i, sensor->filter.value, sensor->filter.raw_value, -1);
+    }
+  }
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    Client* client = &daemon->clients[i];
+    if (client->in_use && client->queue_count > 0 && !client->waiting_for_write && flush_client(client) == -1) {
+      close_client(client);
+    }
+  }
+}
+
+// Handler for requests arriving on a control socket connection
+// While a response is blocked no further requests are read, which pushes
+// back on clients that do not read their responses
+void handle_client(void* data, uint32_t events) {
+  Client* client = data;
+  if ((events & EPOLLOUT) && flush_client(client) == -1) {
+    close_client(client);
+    return;
+  }
+  BmRequest request;
+  while (!client->has_pending_response) {
+    // MSG_TRUNC returns the full frame length, longer frames are cut silently otherwise
+    ssize_t length = recv(client->source.fd, &request, sizeof(request), MSG_DONTWAIT | MSG_TRUNC);
+    if (length == -1 && (errno == EAGAIN || errno == EINTR)) {
+      break;
+    }
+    if (length <= 0) {
+      close_client(client);
+      return;
+    }
+    BmResponse* response = &client->pending_response;
+    if (length != sizeof(request)) {
+      memset(response, 0, sizeof(*response));
+      response->version = BM_PROTOCOL_VERSION;
+      response->status = -EBADMSG;
+    } else {
+      if (request.type == BM_REQUEST_SUBSCRIBE && request.version == BM_PROTOCOL_VERSION) {
+        client->subscriptions = (uint32_t)request.value;
+      }
+      handle_request(client->daemon, &request, response);
+      if (request.type == BM_REQUEST_ATTACH_RING && response->status == 0) {
+        int result = send_ring_frame(client, response);
+        if (result == 1) {
+          continue;
+        }
+        if (result == -1) {
+          close_client(client);
+          return;
+        }
+        // The descriptors cannot be queued, the client has to retry
+        response->status = -EAGAIN;
+      }
+    }
+    client->has_pending_response = true;
+    if (flush_client(client) == -1) {
+      close_client(client);
+      return;
+    }
+  }
+  if (events & (EPOLLHUP | EPOLLERR)) {
+    close_client(client);
+  }
+}
+
+// Handler for new connections on the control socket
+void handle_listener(void* data, uint32_t events) {
+  Daemon* daemon = data;
+  (void)events;
+  int fd;
+  while ((fd = accept4(daemon->listener.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    Client* client = NULL;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+      if (!daemon->clients[i].in_use) {
+        client = &daemon->clients[i];
+        break;
+      }
+    }
+    if (client == NULL) {
+      // Too many connections, the client sees the socket closed
+      close(fd);
+      continue;
+    }
+    memset(client, 0, sizeof(*client));
+    client->source = (EventSource){ fd, handle_client, client };
+    client->daemon = daemon;
+    client->in_use = true;
+    client->epoll_events = EPOLLIN;
+    if (add_event_source(daemon->epoll_fd, &client->source, EPOLLIN) == -1) {
+      close(fd);
+      client->in_use = false;
+    }
+  }
+}
+
+// Function to create the listening control socket
+int open_listener(Daemon* daemon) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  bm_socket_path(address.sun_path, sizeof(address.sun_path));
+  strncpy(daemon->socket_path, address.sun_path, sizeof(daemon->socket_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("Error creating the control socket");
+    return -1;
+  }
+  // Remove a stale socket of a daemon that did not shut down cleanly
+  unlink(address.sun_path);
+  // Only the owner may connect
+  mode_t mask = umask(0077);
+  int result = bind(fd, (struct sockaddr*)&address, sizeof(address));
+  umask(mask);
+  if (result == -1 || listen(fd, MAX_CLIENTS) == -1) {
+    perror("Error binding the control socket");
+    close(fd);
+    return -1;
+  }
+  daemon->listener = (EventSource){ fd, handle_listener, daemon };
+  return add_event_source(daemon->epoll_fd, &daemon->listener, EPOLLIN);
+}
+
+// Function to close the control socket and every connection
+void close_listener(Daemon* daemon) {
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    if (daemon->clients[i].in_use) {
+      close_client(&daemon->clients[i]);
+    }
+  }
+  if (daemon->listener.fd != -1) {
+    close(daemon->listener.fd);
+    unlink(daemon->socket_path);
+  }
+}
+
+// Function to create the shared memory status page
+int open_status_page(Daemon* daemon) {
+  bm_runtime_path(daemon->status_path, sizeof(daemon->status_path), BM_STATUS_NAME, BM_STATUS_SUFFIX);
+  // The fallback path is in /tmp, never follow or reuse what is found there
+  unlink(daemon->status_path);
+  int fd = open(daemon->status_path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    perror("Error creating the status page");
+    return -1;
+  }
+  if (ftruncate(fd, sizeof(BmStatusPage)) == -1) {
+    perror("Error sizing the status page");
+    close(fd);
+    return -1;
+  }
+  daemon->status = mmap(NULL, sizeof(BmStatusPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (daemon->status == MAP_FAILED) {
+    perror("Error mapping the status page");
+    daemon->status = NULL;
+    return -1;
+  }
+  daemon->status->magic = BM_STATUS_MAGIC;
+  daemon->status->version = BM_STATUS_VERSION;
+  daemon->status->pid = (int32_t)getpid();
+  return 0;
+}
+
+// Function to update the status page, called once per event loop iteration
+// Only memory is written, so this adds no syscall to the loop
+void publish_status(Daemon* daemon) {
+  BmStatusPage* page = daemon->status;
+  if (page == NULL) {
+    return;
+  }
+  uint32_t sequence = atomic_load_explicit(&page->sequence, memory_order_relaxed);
+  atomic_store_explicit(&page->sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  page->tick = daemon->wakeups;
+  page->ambient_mode = daemon->ambient_mode;
+  page->output_count = (uint8_t)daemon->output_count;
+  page->sensor_count = (uint8_t)daemon->sensor_count;
+  for (int i = 0; i < daemon->output_count; i++) {
+    fill_output_state(&daemon->outputs[i], &page->outputs[i]);
+  }
+  for (int i = 0; i < daemon->sensor_count; i++) {
+    const Sensor* sensor = &daemon->sensors[i];
+    BmSensorState* state = &page->sensors[i];
+    strncpy(state->name, sensor->config->name, sizeof(state->name) - 1);
+    state->raw_value = sensor->filter.raw_value;
+    state->value = sensor->filter.value;
+    state->available = sensor->available;
+  }
+
+  atomic_store_explicit(&page->sequence, sequence + 2, memory_order_release);
+}
+
+// Function to remove the status page
+// Readers may keep the page mapped, so it is marked as closed first
+void close_status_page(Daemon* daemon) {
+  BmStatusPage* page = daemon->status;
+  if (page != NULL) {
+    uint32_t sequence = atomic_load_explicit(&page->sequence, memory_order_relaxed);
+    atomic_store_explicit(&page->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    page->magic = 0;
+    atomic_store_explicit(&page->sequence, sequence + 2, memory_order_release);
+    munmap(page, sizeof(BmStatusPage));
+    unlink(daemon->status_path);
+    daemon->status = NULL;
+  }
+}
+
+// Function to prepare a new command ring
+void ring_init(BmCommandRing* ring) {
+  memset(ring, 0, sizeof(*ring));
+  ring->magic = BM_RING_MAGIC;
+  ring->size = BM_RING_SIZE;
+  for (uint32_t i = 0; i < BM_RING_SIZE; i++) {
+    atomic_store_explicit(&ring->slots[i].sequence, i, memory_order_relaxed);
+  }
+  atomic_store_explicit(&ring->armed, 1, memory_order_release);
+}
+
+// Function to check for commands the consumer has not taken yet
+bool ring_pending(BmCommandRing* ring) {
+  uint32_t position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  BmRingSlot* slot = &ring->slots[position & (BM_RING_SIZE - 1)];
+  return atomic_load_explicit(&slot->sequence, memory_order_acquire) == position + 1 ||
+         atomic_load_explicit(&ring->overflow_adjustment, memory_order_relaxed) != 0 ||
+         atomic_load_explicit(&ring->overflow_toggles, memory_order_relaxed) != 0;
+}
+
+// Function to add an adjustment taken from the ring to a running sum
+// Any program attached to the ring writes these values, so each entry and
+// the sum are kept within one full sweep of the brightness
+int add_ring_adjustment(int sum, int32_t adjustment) {
+  if (adjustment > RING_MAX_ADJUSTMENT) {
+    adjustment = RING_MAX_ADJUSTMENT;
+  } else if (adjustment < -RING_MAX_ADJUSTMENT) {
+    adjustment = -RING_MAX_ADJUSTMENT;
+  }
+  sum += adjustment;
+  if (sum > RING_MAX_ADJUSTMENT) {
+    return RING_MAX_ADJUSTMENT;
+  }
+  return (sum < -RING_MAX_ADJUSTMENT) ? -RING_MAX_ADJUSTMENT : sum;
+}
+
+// Function to take the queued commands out of the ring
+// Like read_fifo, the commands are coalesced into one. The doorbell is
+// armed again once the ring is empty. Returns false if nothing was queued.
+bool ring_drain(BmCommandRing* ring, int doorbell, BmPipeData* command) {
+  uint32_t toggles = 0;
+  int taken = 0;
+  bool received = false;
+  command->brightness_adjustment = 0;
+  command->ambient_mode = false;
+
+  for (;;) {
+    uint32_t position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (; taken < RING_BATCH; taken++, position++) {
+      BmRingSlot* slot = &ring->slots[position & (BM_RING_SIZE - 1)];
+      if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != position + 1) {
+        break;
+      }
+      command->brightness_adjustment = add_ring_adjustment(command->brightness_adjustment, slot->command.brightness_adjustment);
+      toggles += (slot->command.ambient_mode != 0) ? 1 : 0;
+      atomic_store_explicit(&slot->sequence, position + BM_RING_SIZE, memory_order_release);
+      received = true;
+    }
+    atomic_store_explicit(&ring->tail, position, memory_order_relaxed);
+    int32_t overflow = atomic_exchange_explicit(&ring->overflow_adjustment, 0, memory_order_acquire);
+    uint32_t overflow_toggles = atomic_exchange_explicit(&ring->overflow_toggles, 0, memory_order_acquire);
+    command->brightness_adjustment = add_ring_adjustment(command->brightness_adjustment, overflow);
+    toggles += overflow_toggles;
+    received = received || overflow != 0 || overflow_toggles != 0;
+
+    if (taken >= RING_BATCH) {
+      // Keep the loop responsive under a flood, continue on the next wakeup
+      eventfd_write(doorbell, 1);
+      break;
+    }
+    atomic_store_explicit(&ring->armed, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!ring_pending(ring)) {
+      break;
+    }
+  }
+  command->ambient_mode = (toggles % 2) == 1;
+  return received;
+}
+
+// Handler for the doorbell of the command ring
+void handle_ring(void* data, uint32_t events) {
+  Daemon* daemon = data;
+  (void)events;
+  eventfd_t count;
+  eventfd_read(daemon->doorbell.fd, &count);
+  BmPipeData command;
+  if (ring_drain(daemon->ring, daemon->doorbell.fd, &command)) {
+    apply_command(daemon, &command);
+  }
+}
+
+// Function to create the command ring and its doorbell
+// Clients receive both descriptors with BM_REQUEST_ATTACH_RING
+int open_command_ring(Daemon* daemon) {
+  daemon->ring_fd = memfd_create("backlight_manager-ring", MFD_CLOEXEC);
+  if (daemon->ring_fd == -1) {
+    perror("Error creating the command ring");
+    return -1;
+  }
+  if (ftruncate(daemon->ring_fd, sizeof(BmCommandRing)) == -1) {
+    perror("Error sizing the command ring");
+    close(daemon->ring_fd);
+    return -1;
+  }
+  BmCommandRing* ring = mmap(NULL, sizeof(BmCommandRing), PROT_READ | PROT_WRITE, MAP_SHARED, daemon->ring_fd, 0);
+  if (ring == MAP_FAILED) {
+    perror("Error mapping the command ring");
+    close(daemon->ring_fd);
+    return -1;
+  }
+  ring_init(ring);
+  daemon->doorbell = (EventSource){ eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), handle_ring, daemon };
+  if (daemon->doorbell.fd == -1 || add_event_source(daemon->epoll_fd, &daemon->doorbell, EPOLLIN) == -1) {
+    perror("Error creating the command ring doorbell");
+    if (daemon->doorbell.fd != -1) {
+      close(daemon->doorbell.fd);
+    }
+    munmap(ring, sizeof(BmCommandRing));
+    close(daemon->ring_fd);
+    return -1;
+  }
+  daemon->ring = ring;
+  return 0;
+}
+
+// Function to remove the command ring
+void close_command_ring(Daemon* daemon) {
+  if (daemon->ring != NULL) {
+    close(daemon->doorbell.fd);
+    munmap(daemon->ring, sizeof(BmCommandRing));
+    close(daemon->ring_fd);
+    daemon->ring = NULL;
+  }
+}
+
+// Run the daemon event loop until a termination signal arrives
+// Control messages, sensor and transition timers and signals are all readiness
+// sources of a single epoll instance, so the daemon only wakes up when there is work
+void run_daemon(ConfigData* config, bool ambient_mode) {
+  static Daemon daemon;
+  memset(&daemon, 0, sizeof(daemon));
+  daemon.config = config;
+  daemon.ambient_mode = ambient_mode;
+  daemon.running = true;
+  daemon.started_ms = monotonic_ms();
+  daemon.listener.fd = -1;
+  openlog("backlight_manager", LOG_PID, LOG_DAEMON);
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGUSR1);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+    perror("Error blocking daemon signals");
+    exit(EXIT_FAILURE);
+  }
+
+  daemon.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  daemon.control = (EventSource){ open_pipe(), handle_control, &daemon };
+  daemon.signals = (EventSource){ signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC), handle_signals, &daemon };
+  daemon.reconcile = (EventSource){ timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), handle_reconcile_timer, &daemon };
+  daemon.clock = (EventSource){ timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC), handle_clock_change, &daemon };
+  daemon.display_probe = (EventSource){ timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), handle_display_probe, &daemon };
+  daemon.display_on = true;
+  daemon.suspended_ns = suspended_ns();
+  if (daemon.epoll_fd == -1 || daemon.signals.fd == -1 || daemon.reconcile.fd == -1 || daemon.clock.fd == -1 ||
+      daemon.display_probe.fd == -1 || arm_clock_watch(&daemon) == -1) {
+    perror("Error setting up the event loop");
+    exit(EXIT_FAILURE);
+  }
+  if (add_event_source(daemon.epoll_fd, &daemon.control, EPOLLIN) == -1 ||
+      add_event_source(daemon.epoll_fd, &daemon.signals, EPOLLIN) == -1 ||
+      add_event_source(daemon.epoll_fd, &daemon.reconcile, EPOLLIN) == -1 ||
+      add_event_source(daemon.epoll_fd, &daemon.clock, EPOLLIN) == -1 ||
+      add_event_source(daemon.epoll_fd, &daemon.display_probe, EPOLLIN) == -1) {
+    exit(EXIT_FAILURE);
+  }
+  open_registry(&daemon);
+  check_display_power(&daemon);
+  arm_reconcile_timer(&daemon);
+  arm_display_probe(&daemon);
+  open_hotplug(&daemon);
+  open_inputs(&daemon);
+  if (open_listener(&daemon) == -1) {
+    fprintf(stderr, "Control socket not available, only the named pipe is served\n");
+  }
+  open_command_ring(&daemon);
+  open_status_page(&daemon);
+  publish_status(&daemon);
+
+  set_ambient_timer(&daemon, ambient_active(&daemon));
+
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+  while (daemon.running) {
+    int count = epoll_wait(daemon.epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+    if (count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Error waiting for events");
+      break;
+    }
+    daemon.wakeups++;
+    // Timers that expired during a suspend must not run on the stale state
+    check_resume(&daemon);
+    for (int i = 0; i < count; i++) {
+      EventSource* source = events[i].data.ptr;
+      source->handler(source->data, events[i].events);
+    }
+    check_display_power_on_wakeup(&daemon);
+    publish_changes(&daemon);
+    publish_status(&daemon);
+  }
+
+  close_status_page(&daemon);
+  close_command_ring(&daemon);
+  close_listener(&daemon);
+  close_inputs(&daemon);
+  close_registry(&daemon);
+  if (daemon.hotplug.source.fd != -1) {
+    close(daemon.hotplug.source.fd);
+  }
+  close(daemon.display_probe.fd);
+  close(daemon.clock.fd);
+  close(daemon.reconcile.fd);
+  close(daemon.signals.fd);
+  close(daemon.control.fd);
+  close(daemon.epoll_fd);
+  if (remove(PID_FILE_PATH) == -1) {
+    perror("Error removing the PID file");
+  }
+  closelog();
+}
+
+// Function to send a request to the daemon and wait for the response
+int send_request(BmClient* client, int type, int output, int value, uint32_t flags, BmResponse* response) {
+  int result = bm_request(client, type, output, value, flags, response);
+  if (result < 0) {
+    fprintf(stderr, "Request failed: %s\n", strerror(-result));
+    return -1;
+  }
+  return 0;
+}
+
+// Function to feed brightness changes read from stdin into the command ring
+// Each line holds a brightness change in percent, or "t" to toggle ambient
+// mode. Meant for input helpers that produce changes at key repeat rate.
+int feed_daemon() {
+  BmClient* client = bm_connect();
+  if (client == NULL) {
+    fprintf(stderr, "No daemon is running\n");
+    return 1;
+  }
+  BmCommandRing* ring;
+  int doorbell;
+  int result = bm_attach_ring(client, &ring, &doorbell);
+  bm_disconnect(client);
+  if (result < 0) {
+    fprintf(stderr, "Command ring not available: %s\n", strerror(-result));
+    return 1;
+  }
+  char line[64];
+  while (fgets(line, sizeof(line), stdin) != NULL) {
+    BmPipeData command;
+    command.ambient_mode = (line[0] == 't');
+    command.brightness_adjustment = command.ambient_mode ? 0 : atoi(line);
+    if (command.ambient_mode || command.brightness_adjustment != 0) {
+      bm_ring_push(ring, doorbell, &command);
+    }
+  }
+  bm_detach_ring(ring, doorbell);
+  return 0;
+}
+
+// Function to print the live state of the daemon from its status page
+void print_status_page(const BmStatusPage* status) {
+  printf("Backlight Manager Status:\n");
+  printf("  Ambient Mode: %s\n", status->ambient_mode ? "on" : "off");
+  printf("  Tick: %llu\n", (unsigned long long)status->tick);
+  for (int i = 0; i < status->output_count && i < BM_PROTOCOL_MAX_OUTPUTS; i++) {
+    const BmOutputState* output = &status->outputs[i];
+    if (!(output->flags & BM_OUTPUT_FLAG_AVAILABLE)) {
+      printf("  Output %s: not available\n", output->name);
+    } else {
+      printf("  Output %s: brightness %d/%d, target %d%s%s\n", output->name, output->current, output->max, output->target,
+             (output->flags & BM_OUTPUT_FLAG_PAUSED) ? ", paused" : "",
+             (output->flags & BM_OUTPUT_FLAG_DISPLAY_OFF) ? ", display off" : "");
+    }
+  }
+  for (int i = 0; i < status->sensor_count && i < BM_PROTOCOL_MAX_SENSORS; i++) {
+    const BmSensorState* sensor = &status->sensors[i];
+    if (!sensor->available) {
+      printf("  Sensor %s: not available\n", sensor->name);
+    } else {
+      printf("  Sensor %s: raw %d, filtered %d\n", sensor->name, sensor->raw_value, sensor->value);
+    }
+  }
+}
+
+// Function to print the statistics of the daemon
+void print_daemon_statistics(const BmResponse* stats) {
+  printf("Backlight Manager Statistics:\n");
+  printf("  Uptime: %llu ms\n", (unsigned long long)stats->stats.uptime_ms);
+  printf("  Wakeups: %llu (%llu per hour)\n", (unsigned long long)stats->stats.wakeups,
+         (unsigned long long)stats->stats.wakeups_per_hour);
+  for (int i = 0; i < stats->output_count && i < BM_PROTOCOL_MAX_OUTPUTS; i++) {
+    printf("  Output %d: writes %llu, suppressed writes %llu, external changes %llu\n", i,
+           (unsigned long long)stats->stats.outputs[i].writes,
+           (unsigned long long)stats->stats.outputs[i].suppressed_writes,
+           (unsigned long long)stats->stats.outputs[i].external_changes);
+  }
+  for (int i = 0; i < stats->sensor_count && i < BM_PROTOCOL_MAX_SENSORS; i++) {
+    const BmSensorStats* sensor = &stats->stats.sensors[i];
+    printf("  Sensor %s: interval %d ms, samples %llu, rejected spikes %llu, burst variance %u\n",
+           sensor->name, sensor->interval_ms,
+           (unsigned long long)sensor->samples, (unsigned long long)sensor->rejected_spikes, sensor->burst_variance);
+  }
+}
+
+// Callback printing one line per event of a subscription
+void print_event(void* data, const BmResponse* frame) {
+  const BmResponse* state = data;
+  if (frame->type == BM_EVENT_OUTPUT && frame->event.index >= 0 && frame->event.index < BM_PROTOCOL_MAX_OUTPUTS) {
+    printf("output %s %d/%d target %d\n", state->outputs[frame->event.index].name,
+           frame->event.value, frame->event.max, frame->event.target);
+  } else if (frame->type == BM_EVENT_AMBIENT) {
+    printf("ambient %s\n", frame->event.value ? "on" : "off");
+  } else if (frame->type == BM_EVENT_SENSOR) {
+    printf("sensor %d %d raw %d\n", frame->event.index, frame->event.value, frame->event.target);
+  }
+}
+
+// Function to follow the daemon state and print one line per change
+// Meant for status bars, which then no longer need to poll sysfs
+int watch_daemon() {
+  BmClient* client = bm_connect();
+  BmResponse state;
+  if (client == NULL) {
+    fprintf(stderr, "No daemon is running\n");
+    return 1;
+  }
+  if (send_request(client, BM_REQUEST_SUBSCRIBE, BM_PROTOCOL_ALL_OUTPUTS, BM_EVENT_MASK_OUTPUT | BM_EVENT_MASK_AMBIENT | BM_EVENT_MASK_SENSOR, 0, &state) == -1) {
+    bm_disconnect(client);
+    return 1;
+  }
+  printf("ambient %s\n", state.ambient_mode ? "on" : "off");
+  for (int i = 0; i < state.output_count && i < BM_PROTOCOL_MAX_OUTPUTS; i++) {
+    printf("output %s %d/%d\n", state.outputs[i].name, state.outputs[i].current, state.outputs[i].max);
+  }
+  fflush(stdout);
+  bm_set_handler(client, print_event, &state);
+  struct pollfd descriptor = { bm_get_fd(client), POLLIN, 0 };
+  while (poll(&descriptor, 1, -1) != -1 || errno == EINTR) {
+    if (bm_dispatch(client) < 0) {
+      break;
+    }
+    fflush(stdout);
+  }
+  bm_disconnect(client);
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  bool ambient_mode = false; // Default value: ambient mode disabled
+  int brightness_adjustment = 0; // Default value: no brightness adjustment
+  int set_brightness = -1; // Default value: do not set an absolute brightness
+  bool daemon_mode = false; // Default value: dont run as daemon
+  bool print_status = false; // Default value: do not print status
+  // Parse command-line options using getopt
+  // The config is only read once it is clear that this process drives the
+  // hardware itself, client commands just locate and talk to the daemon
+
+  int option;
+  const char* short_options = "hpdkwias:b:";
+  static struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"ambient", no_argument, NULL, 'a'},
+    {"daemon", no_argument, NULL, 'd'},
+    {"kill", no_argument, NULL, 'k'},
+    {"print-status", no_argument, NULL, 'p'},
+    {"watch", no_argument, NULL, 'w'},
+    {"input", no_argument, NULL, 'i'},
+    {"set", required_argument, NULL, 's'},
+    {"brightness", required_argument, NULL, 'b'},
+    {NULL, 0, NULL, 0}
+  };
+
+  FILE* pid_file = fopen(PID_FILE_PATH, "r");
+
+  while ((option = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+    switch (option) {
+      case 'h':
+        display_usage();
+        return 0;
+      case 'a':
+        ambient_mode = true;
+        break;
+      case 'd':
+        daemon_mode = true;
+        break;
+      case 'k':
+        stop_daemon();
+        exit(EXIT_SUCCESS);
+      case 'p':
+        print_status = true;
+        break;
+      case 'w':
+        return watch_daemon();
+      case 'i':
+        return feed_daemon();
+      case 's':
+        brightness_adjustment = atoi(optarg);
+        break;
+      case 'b':
+        set_brightness = atoi(optarg);
         break;
       default:
         fprintf(stderr, "Unknown option: %c\n", option);
@@ -407,50 +4857,75 @@ int main(int argc, char* argv[]) {
   }
 
   if (print_status) {
+    ConfigData config = read_config_data();
     print_info(&config);
+    BmStatusPage status;
+    bool have_status = bm_read_status(&status) == 0;
+    if (have_status) {
+      print_status_page(&status);
+    }
+    BmClient* client = bm_connect();
+    BmResponse stats;
+    if (client != NULL && send_request(client, BM_REQUEST_QUERY_STATS, BM_PROTOCOL_ALL_OUTPUTS, 0, 0, &stats) == 0) {
+      print_daemon_statistics(&stats);
+    } else if (!have_status) {
+      request_statistics();
+    }
+    bm_disconnect(client);
     return 0;
   }
 
-  if (daemon_mode) {
-      fd = open_pipe();
-  }
-
-    int max_screen_brightness = read_file(config.screen_backlight_path, "max_brightness");
-    config.min_brightness = (int)((max_screen_brightness / 100.0) * config.min_brightness);
-    if (pid_file == NULL) {
-
+    if (pid_file != NULL && !daemon_mode) {
+        // Prefer the control socket, the named pipe serves older daemons
+        BmClient* client = bm_connect();
+        if (client == NULL) {
+            // The named pipe only carries adjustments and ambient toggles
+            if (set_brightness >= 0) {
+                fprintf(stderr, "Setting the brightness needs the control socket of the daemon\n");
+                return 1;
+            }
+            write_fifo(brightness_adjustment, ambient_mode);
+            return 0;
+        }
+        BmResponse response;
+        int result = 0;
+        if (set_brightness >= 0) {
+            result |= send_request(client, BM_REQUEST_SET, BM_PROTOCOL_ALL_OUTPUTS, set_brightness, 0, &response);
+        }
         if (brightness_adjustment != 0) {
-            adjust_brightness(brightness_adjustment, max_screen_brightness, &config);
+            result |= send_request(client, BM_REQUEST_ADJUST, BM_PROTOCOL_ALL_OUTPUTS, brightness_adjustment, 0, &response);
+        }
+        if (ambient_mode) {
+            result |= send_request(client, BM_REQUEST_TOGGLE_AMBIENT, BM_PROTOCOL_ALL_OUTPUTS, 0, 0, &response);
         }
-    } else if (!daemon_mode){
-        write_fifo(brightness_adjustment, ambient_mode);
+        bm_disconnect(client);
+        return (result == 0) ? 0 : 1;
     }
 
-
-  while (daemon_mode) {
-    PipeData* data = read_fifo(fd);
-    if (data != NULL) {
-      brightness_adjustment = data->brightness_adjustment;
-      if (data->ambient_mode) {
-          if (ambient_mode) {
-              ambient_mode = !data->ambient_mode;
-          } else {
-              ambient_mode = data->ambient_mode;
-          }
-      }
-      free(data);
-    }
-    if (brightness_adjustment != 0) {
-      adjust_brightness(brightness_adjustment, max_screen_brightness, &config);
-      brightness_adjustment = 0;
+    if (pid_file == NULL && (brightness_adjustment != 0 || set_brightness >= 0)) {
+        // No daemon running, adjust the manual outputs directly
+        ConfigData config = read_config_data();
+        for (int i = 0; i < config.output_count; i++) {
+            Backlight backlight;
+            if (config.outputs[i].manual && open_backlight(&backlight, config.outputs[i].path) == 0) {
+                if (set_brightness >= 0) {
+                    set_backlight_brightness(&backlight, (int)((backlight.max_brightness / 100.0) * set_brightness));
+                }
+                if (brightness_adjustment != 0) {
+                    adjust_brightness(brightness_adjustment, &backlight);
+                }
+                close_backlight(&backlight);
+            }
+        }
     }
-    if (ambient_mode) {
-      double illumination = read_file(config.sensor_file_path, config.sensor_file);
-      int tmp_backlight_value = (int)(illumination * config.brightness_factor);
-      int backlight_value = (tmp_backlight_value > config.min_brightness) ? tmp_backlight_value : config.min_brightness;
-      set_backlight_brightness(config.screen_backlight_path, backlight_value, max_screen_brightness);
+
+  if (daemon_mode) {
+    // Read before start_daemon changes the working directory
+    ConfigData config = read_config_data();
+    if (pid_file == NULL) {
+      start_daemon();
     }
-    sleep(config.update_rate);
+    run_daemon(&config, ambient_mode);
   }
 
   return 0;
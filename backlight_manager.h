@@ -0,0 +1,292 @@
+/*
+ * backlight_manager.h - Protocol and client library of backlight_manager.
+ *
+ * Copyright (C) 2023 Adrian Danzglock <caedael@posteo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BACKLIGHT_MANAGER_H
+#define BACKLIGHT_MANAGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Message of the named pipe, also the entry type of the command ring
+// Only fixed width fields, the ring is shared with other programs
+typedef struct {
+  int32_t brightness_adjustment;
+  uint8_t ambient_mode;
+  uint8_t reserved[3];
+} BmPipeData;
+
+#define BM_SOCKET_NAME "backlight_manager.sock"
+#define BM_PROTOCOL_VERSION 1
+#define BM_PROTOCOL_MAX_OUTPUTS 8
+#define BM_PROTOCOL_MAX_SENSORS 4
+#define BM_PROTOCOL_ALL_OUTPUTS -1
+
+// Requests of the control socket protocol
+typedef enum {
+  BM_REQUEST_SET = 1,
+  BM_REQUEST_ADJUST,
+  BM_REQUEST_TOGGLE_AMBIENT,
+  BM_REQUEST_ENABLE_AMBIENT,
+  BM_REQUEST_DISABLE_AMBIENT,
+  BM_REQUEST_QUERY_STATE,
+  BM_REQUEST_QUERY_STATS,
+  BM_REQUEST_SUBSCRIBE,
+  BM_REQUEST_ATTACH_RING
+} BmRequestType;
+
+// Frames pushed by the daemon to subscribed clients
+typedef enum {
+  BM_EVENT_OUTPUT = 0x100,
+  BM_EVENT_AMBIENT,
+  BM_EVENT_SENSOR
+} BmEventType;
+
+// Event mask of a subscribe request
+#define BM_EVENT_MASK_OUTPUT 0x1
+#define BM_EVENT_MASK_AMBIENT 0x2
+#define BM_EVENT_MASK_SENSOR 0x4
+
+// Flags of a request
+#define BM_REQUEST_FLAG_RAW 0x1 // value is in raw brightness units instead of percent
+
+// Flags of an output in a state response
+#define BM_OUTPUT_FLAG_AVAILABLE 0x1
+#define BM_OUTPUT_FLAG_MANUAL 0x2
+#define BM_OUTPUT_FLAG_AMBIENT 0x4
+#define BM_OUTPUT_FLAG_PAUSED 0x8
+#define BM_OUTPUT_FLAG_DISPLAY_OFF 0x10
+
+// Request frame sent by clients over the SOCK_SEQPACKET control socket
+// output is an index into the state response or BM_PROTOCOL_ALL_OUTPUTS for
+// every output that takes manual adjustments
+typedef struct {
+  uint16_t version;
+  uint16_t type;
+  uint32_t sequence;
+  int32_t output;
+  int32_t value;
+  uint32_t flags;
+  uint32_t reserved;
+} BmRequest;
+
+// State of one output in a response frame
+typedef struct {
+  char name[16];
+  int32_t current;
+  int32_t target;
+  int32_t max;
+  uint32_t flags;
+} BmOutputState;
+
+// Counters of one output in a statistics response
+typedef struct {
+  uint64_t writes;
+  uint64_t suppressed_writes;
+  uint64_t external_changes;
+} BmOutputStats;
+
+// Counters of one sensor in a statistics response
+typedef struct {
+  char name[16];
+  uint64_t samples;
+  uint64_t rejected_spikes;
+  int32_t interval_ms;
+  int32_t raw_value;
+  int32_t value;
+  uint32_t available;
+  // Variance of the readings in the last burst, 0 without burst sampling
+  uint32_t burst_variance;
+  uint32_t reserved;
+} BmSensorStats;
+
+// Payload of an event frame
+// For output events value is the current and target the target brightness,
+// for sensor events value is the filtered and target the raw reading
+typedef struct {
+  int32_t index;
+  int32_t value;
+  int32_t target;
+  int32_t max;
+} BmEventData;
+
+// Response frame, every request is answered with exactly one response
+// status is 0 on success or a negative errno value. Subscribed clients also
+// receive frames of the same size with an BmEventType as type.
+typedef struct {
+  uint16_t version;
+  uint16_t type;
+  uint32_t sequence;
+  int32_t status;
+  uint8_t ambient_mode;
+  uint8_t output_count;
+  uint8_t sensor_count;
+  uint8_t reserved;
+  union {
+    BmOutputState outputs[BM_PROTOCOL_MAX_OUTPUTS];
+    struct {
+      uint64_t uptime_ms;
+      uint64_t wakeups;
+      uint64_t wakeups_per_hour;
+      BmOutputStats outputs[BM_PROTOCOL_MAX_OUTPUTS];
+      BmSensorStats sensors[BM_PROTOCOL_MAX_SENSORS];
+    } stats;
+    BmEventData event;
+  };
+} BmResponse;
+
+#define BM_STATUS_NAME "backlight_manager.status"
+#define BM_STATUS_SUFFIX "status"
+#define BM_STATUS_MAGIC 0x534d4c42 // "BLMS"
+#define BM_STATUS_VERSION 1
+
+// Live values of one sensor on the status page
+typedef struct {
+  char name[16];
+  int32_t raw_value;
+  int32_t value;
+  uint32_t available;
+  uint32_t reserved;
+} BmSensorState;
+
+// Shared memory status page published by the daemon
+// The daemon is the only writer. sequence is odd while an update is in
+// progress, readers copy the page and retry until they saw the same even
+// sequence before and after the copy, so reading a page mapped with
+// bm_map_status needs no syscall or lock.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  _Atomic uint32_t sequence;
+  int32_t pid;
+  uint64_t tick;
+  uint8_t ambient_mode;
+  uint8_t output_count;
+  uint8_t sensor_count;
+  uint8_t reserved[5];
+  BmOutputState outputs[BM_PROTOCOL_MAX_OUTPUTS];
+  BmSensorState sensors[BM_PROTOCOL_MAX_SENSORS];
+} BmStatusPage;
+
+#define BM_RING_SIZE 256 // Must be a power of two
+#define BM_RING_MAGIC 0x524d4c42 // "BLMR"
+
+// One command in the shared command ring
+// sequence tells producers and the consumer who owns the slot
+typedef struct {
+  _Atomic uint32_t sequence;
+  BmPipeData command;
+} BmRingSlot;
+
+// Shared memory ring of commands from input clients to the daemon
+// Any number of producers enqueue without locks, the daemon is the only
+// consumer. Producers only write the eventfd doorbell when the daemon
+// armed it before going to sleep. When the ring is full, adjustments are
+// summed into the overflow counters instead of blocking the producer.
+typedef struct {
+  uint32_t magic;
+  uint32_t size;
+  _Alignas(64) _Atomic uint32_t head;
+  _Alignas(64) _Atomic uint32_t tail;
+  _Atomic uint32_t armed;
+  _Atomic int32_t overflow_adjustment;
+  _Atomic uint32_t overflow_toggles;
+  _Alignas(64) BmRingSlot slots[BM_RING_SIZE];
+} BmCommandRing;
+
+// Connection of a client to the daemon
+typedef struct BmClient BmClient;
+
+// Mapping of the status page of the daemon
+typedef struct BmStatus BmStatus;
+
+// Callback for frames that are not the answer of a blocking request
+// These are events of a subscription and responses of requests sent with
+// bm_send or one of its wrappers.
+typedef void (*BmHandler)(void* data, const BmResponse* frame);
+
+// Function to construct the path of a file in the runtime directory
+void bm_runtime_path(char* path, size_t size, const char* name, const char* suffix);
+
+// Function to construct the path of the control socket
+void bm_socket_path(char* path, size_t size);
+
+// Function to connect to the daemon, returns NULL with errno set if none is listening
+// The connection is non-blocking, its descriptor can be polled for input
+BmClient* bm_connect(void);
+
+// Function to close a connection
+void bm_disconnect(BmClient* client);
+
+// Function to get the descriptor to poll for frames
+int bm_get_fd(const BmClient* client);
+
+// Function to install the callback called by bm_dispatch
+void bm_set_handler(BmClient* client, BmHandler handler, void* data);
+
+// Function to send a request without waiting for the response
+// Returns the sequence number of the request or a negative errno value
+int bm_send(BmClient* client, int type, int output, int value, uint32_t flags);
+
+// Function to pass every frame already received to the handler
+// Returns the number of frames or a negative errno value, -ECONNRESET once
+// the daemon closed the connection
+int bm_dispatch(BmClient* client);
+
+// Function to send a request and wait for its response
+// Frames arriving in the meantime are passed to the handler. Returns 0 or a
+// negative errno value, including the status of a failed request.
+int bm_request(BmClient* client, int type, int output, int value, uint32_t flags, BmResponse* response);
+
+// Non-blocking requests, the responses are passed to the handler
+int bm_adjust(BmClient* client, int output, int percent);
+int bm_set(BmClient* client, int output, int percent);
+int bm_toggle_ambient(BmClient* client);
+int bm_query_state(BmClient* client);
+int bm_query_stats(BmClient* client);
+int bm_subscribe(BmClient* client, uint32_t mask);
+
+// Function to map the command ring of the daemon, waits for the daemon
+int bm_attach_ring(BmClient* client, BmCommandRing** ring, int* doorbell);
+
+// Function to unmap a command ring
+void bm_detach_ring(BmCommandRing* ring, int doorbell);
+
+// Function to queue a command in the ring without a syscall
+// The doorbell is only written when the daemon is idle
+void bm_ring_push(BmCommandRing* ring, int doorbell, const BmPipeData* command);
+
+// Function to map the status page, returns NULL with errno set if there is none
+BmStatus* bm_map_status(void);
+
+// Function to unmap the status page
+void bm_unmap_status(BmStatus* status);
+
+// Function to copy a consistent snapshot out of the mapped status page
+// Returns -1 if the daemon that published the page is gone, or with errno
+// set to EAGAIN if the page kept changing. After a daemon restart the page
+// has to be mapped again.
+int bm_status_snapshot(BmStatus* status, BmStatusPage* snapshot);
+
+// Function to read a consistent snapshot of the status page
+// Maps the page for the call only, see bm_status_snapshot for the result
+int bm_read_status(BmStatusPage* snapshot);
+
+#endif
@@ -0,0 +1,453 @@
+/*
+ * libbacklight_manager - Client library of backlight_manager.
+ *
+ * Copyright (C) 2023 Adrian Danzglock <caedael@posteo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "backlight_manager.h"
+
+#define STATUS_READ_RETRIES 1000
+#define STATUS_STUCK_RETRIES 16
+
+// Connection of a client to the daemon
+struct BmClient {
+  int fd;
+  uint32_t sequence;
+  BmHandler handler;
+  void* data;
+};
+
+// Mapping of the status page of the daemon
+struct BmStatus {
+  const BmStatusPage* page;
+  bool seen;
+  uint32_t sequence;
+};
+
+// Function to construct the path of a file in the runtime directory
+// It uses the XDG_RUNTIME_DIR environment variable if available, otherwise a per user path in /tmp
+void bm_runtime_path(char* path, size_t size, const char* name, const char* suffix) {
+  const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (runtime_dir != NULL && runtime_dir[0] != '\0') {
+    snprintf(path, size, "%s/%s", runtime_dir, name);
+  } else {
+    snprintf(path, size, "/tmp/backlight_manager-%d.%s", (int)getuid(), suffix);
+  }
+}
+
+// Function to construct the path of the control socket
+void bm_socket_path(char* path, size_t size) {
+  bm_runtime_path(path, size, BM_SOCKET_NAME, "sock");
+}
+
+// Function to connect to the daemon
+BmClient* bm_connect(void) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  bm_socket_path(address.sun_path, sizeof(address.sun_path));
+  BmClient* client = calloc(1, sizeof(*client));
+  if (client == NULL) {
+    return NULL;
+  }
+  client->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (client->fd == -1 || connect(client->fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+    int error = errno;
+    if (client->fd != -1) {
+      close(client->fd);
+    }
+    free(client);
+    errno = error;
+    return NULL;
+  }
+  return client;
+}
+
+// Function to close a connection
+void bm_disconnect(BmClient* client) {
+  if (client != NULL) {
+    close(client->fd);
+    free(client);
+  }
+}
+
+// Function to get the descriptor to poll for frames
+int bm_get_fd(const BmClient* client) {
+  return client->fd;
+}
+
+// Function to install the callback called for frames nobody waits for
+void bm_set_handler(BmClient* client, BmHandler handler, void* data) {
+  client->handler = handler;
+  client->data = data;
+}
+
+// Function to wait until the connection is ready for the given poll events
+static int wait_for(BmClient* client, short events) {
+  struct pollfd descriptor = { client->fd, events, 0 };
+  while (poll(&descriptor, 1, -1) == -1) {
+    if (errno != EINTR) {
+      return -errno;
+    }
+  }
+  return 0;
+}
+
+// Function to send a request frame
+// Returns the sequence number, -EAGAIN if the socket is full when not blocking
+static int send_frame(BmClient* client, int type, int output, int value, uint32_t flags, bool blocking) {
+  BmRequest request;
+  memset(&request, 0, sizeof(request));
+  request.version = BM_PROTOCOL_VERSION;
+  request.type = (uint16_t)type;
+  request.output = output;
+  request.value = value;
+  request.flags = flags;
+  // Sequence numbers stay positive so they fit the return value
+  client->sequence = (client->sequence % INT32_MAX) + 1;
+  request.sequence = client->sequence;
+  for (;;) {
+    if (send(client->fd, &request, sizeof(request), MSG_NOSIGNAL) == sizeof(request)) {
+      return (int)request.sequence;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN || !blocking) {
+      return -errno;
+    }
+    int result = wait_for(client, POLLOUT);
+    if (result < 0) {
+      return result;
+    }
+  }
+}
+
+// Function to receive one frame, with the descriptors attached to it
+// Returns 1 for a frame, 0 if none is waiting and a negative errno value
+// when the connection failed. Descriptors nobody asked for are closed.
+static int receive_frame(BmClient* client, BmResponse* frame, int* fds, int fd_count) {
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(2 * sizeof(int))];
+  } control;
+  struct iovec iov = { frame, sizeof(*frame) };
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.buffer;
+  message.msg_controllen = sizeof(control.buffer);
+  ssize_t length = recvmsg(client->fd, &message, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+  if (length == -1) {
+    return (errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+  }
+  if (length == 0) {
+    return -ECONNRESET;
+  }
+  int received = 0;
+  for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+    if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    int count = (int)((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    for (int i = 0; i < count; i++) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(fd));
+      if (received < fd_count) {
+        fds[received++] = fd;
+      } else {
+        close(fd);
+      }
+    }
+  }
+  for (int i = received; i < fd_count; i++) {
+    fds[i] = -1;
+  }
+  if (length != sizeof(*frame) || frame->version != BM_PROTOCOL_VERSION) {
+    for (int i = 0; i < received; i++) {
+      close(fds[i]);
+    }
+    return -EPROTO;
+  }
+  return 1;
+}
+
+// Function to pass a frame to the handler
+static void deliver(BmClient* client, const BmResponse* frame) {
+  if (client->handler != NULL) {
+    client->handler(client->data, frame);
+  }
+}
+
+// Function to pass every frame already received to the handler
+int bm_dispatch(BmClient* client) {
+  int count = 0;
+  BmResponse frame;
+  int result;
+  while ((result = receive_frame(client, &frame, NULL, 0)) == 1) {
+    deliver(client, &frame);
+    count++;
+  }
+  return (result < 0) ? result : count;
+}
+
+// Function to wait for the response of a request
+// Other frames are passed to the handler while waiting
+static int wait_response(BmClient* client, int sequence, BmResponse* response, int* fds, int fd_count) {
+  for (;;) {
+    int result = receive_frame(client, response, fds, fd_count);
+    if (result == 0) {
+      result = wait_for(client, POLLIN);
+    } else if (result == 1) {
+      if (response->type < BM_EVENT_OUTPUT && response->sequence == (uint32_t)sequence) {
+        return response->status;
+      }
+      deliver(client, response);
+    }
+    if (result < 0) {
+      return result;
+    }
+  }
+}
+
+// Function to send a request without waiting for the response
+int bm_send(BmClient* client, int type, int output, int value, uint32_t flags) {
+  return send_frame(client, type, output, value, flags, false);
+}
+
+// Function to send a request and wait for its response
+int bm_request(BmClient* client, int type, int output, int value, uint32_t flags, BmResponse* response) {
+  int sequence = send_frame(client, type, output, value, flags, true);
+  if (sequence < 0) {
+    return sequence;
+  }
+  return wait_response(client, sequence, response, NULL, 0);
+}
+
+// Non-blocking requests, the responses are passed to the handler
+int bm_adjust(BmClient* client, int output, int percent) {
+  return bm_send(client, BM_REQUEST_ADJUST, output, percent, 0);
+}
+
+int bm_set(BmClient* client, int output, int percent) {
+  return bm_send(client, BM_REQUEST_SET, output, percent, 0);
+}
+
+int bm_toggle_ambient(BmClient* client) {
+  return bm_send(client, BM_REQUEST_TOGGLE_AMBIENT, BM_PROTOCOL_ALL_OUTPUTS, 0, 0);
+}
+
+int bm_query_state(BmClient* client) {
+  return bm_send(client, BM_REQUEST_QUERY_STATE, BM_PROTOCOL_ALL_OUTPUTS, 0, 0);
+}
+
+int bm_query_stats(BmClient* client) {
+  return bm_send(client, BM_REQUEST_QUERY_STATS, BM_PROTOCOL_ALL_OUTPUTS, 0, 0);
+}
+
+int bm_subscribe(BmClient* client, uint32_t mask) {
+  return bm_send(client, BM_REQUEST_SUBSCRIBE, BM_PROTOCOL_ALL_OUTPUTS, (int)mask, 0);
+}
+
+// Function to map the command ring of the daemon
+// The daemon sends the ring and its doorbell along with the response
+int bm_attach_ring(BmClient* client, BmCommandRing** ring, int* doorbell) {
+  int sequence = send_frame(client, BM_REQUEST_ATTACH_RING, BM_PROTOCOL_ALL_OUTPUTS, 0, 0, true);
+  if (sequence < 0) {
+    return sequence;
+  }
+  BmResponse response;
+  int fds[2];
+  int result = wait_response(client, sequence, &response, fds, 2);
+  if (result < 0) {
+    return result;
+  }
+  struct stat info;
+  *ring = MAP_FAILED;
+  if (fds[0] != -1 && fstat(fds[0], &info) == 0 && info.st_size >= (off_t)sizeof(BmCommandRing)) {
+    *ring = mmap(NULL, sizeof(BmCommandRing), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  }
+  if (fds[0] != -1) {
+    close(fds[0]);
+  }
+  if (*ring == MAP_FAILED || fds[1] == -1 || (*ring)->magic != BM_RING_MAGIC || (*ring)->size != BM_RING_SIZE) {
+    if (*ring != MAP_FAILED) {
+      munmap(*ring, sizeof(BmCommandRing));
+    }
+    if (fds[1] != -1) {
+      close(fds[1]);
+    }
+    return -EPROTO;
+  }
+  *doorbell = fds[1];
+  return 0;
+}
+
+// Function to unmap a command ring
+void bm_detach_ring(BmCommandRing* ring, int doorbell) {
+  munmap(ring, sizeof(BmCommandRing));
+  close(doorbell);
+}
+
+// Function to enqueue a command and ring the doorbell if the daemon sleeps
+// Only the doorbell write is a syscall, and only when the daemon is idle
+void bm_ring_push(BmCommandRing* ring, int doorbell, const BmPipeData* command) {
+  uint32_t position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  for (;;) {
+    BmRingSlot* slot = &ring->slots[position & (BM_RING_SIZE - 1)];
+    uint32_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    int32_t difference = (int32_t)(sequence - position);
+    if (difference == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ring->head, &position, position + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        slot->command = *command;
+        atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+        break;
+      }
+    } else if (difference < 0) {
+      // Ring full, coalesce into the overflow counters
+      atomic_fetch_add_explicit(&ring->overflow_adjustment, command->brightness_adjustment, memory_order_release);
+      if (command->ambient_mode) {
+        atomic_fetch_add_explicit(&ring->overflow_toggles, 1, memory_order_release);
+      }
+      break;
+    } else {
+      position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    }
+  }
+  // Pairs with the fence in ring_drain so that either the daemon sees the
+  // command or this producer sees the armed doorbell
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&ring->armed, memory_order_relaxed) &&
+      atomic_exchange_explicit(&ring->armed, 0, memory_order_relaxed)) {
+    eventfd_write(doorbell, 1);
+  }
+}
+
+// Function to take a consistent snapshot of the status page
+// A daemon killed while publishing leaves the sequence odd for good, so the
+// publisher is checked once the sequence stopped changing, and the retries
+// are bounded. Returns -1 with errno set to ESRCH or EAGAIN if no snapshot
+// was taken.
+static int read_status_snapshot(const BmStatusPage* page, BmStatusPage* snapshot) {
+  uint32_t stuck = 0;
+  int unchanged = 0;
+  for (int attempt = 0; attempt < STATUS_READ_RETRIES; attempt++) {
+    uint32_t before = atomic_load_explicit(&((BmStatusPage*)page)->sequence, memory_order_acquire);
+    if (before & 1) {
+      if (before != stuck) {
+        stuck = before;
+        unchanged = 0;
+      } else if (++unchanged == STATUS_STUCK_RETRIES && kill(page->pid, 0) == -1 && errno == ESRCH) {
+        return -1;
+      }
+      sched_yield();
+      continue;
+    }
+    memcpy((void*)snapshot, (const void*)page, sizeof(*snapshot));
+    atomic_thread_fence(memory_order_acquire);
+    uint32_t after = atomic_load_explicit(&((BmStatusPage*)page)->sequence, memory_order_relaxed);
+    if (before == after) {
+      return 0;
+    }
+  }
+  errno = EAGAIN;
+  return -1;
+}
+
+// Function to map the status page of the daemon
+BmStatus* bm_map_status(void) {
+  char path[PATH_MAX];
+  bm_runtime_path(path, sizeof(path), BM_STATUS_NAME, BM_STATUS_SUFFIX);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return NULL;
+  }
+  BmStatusPage* page = mmap(NULL, sizeof(BmStatusPage), PROT_READ, MAP_SHARED, fd, 0);
+  int error = errno;
+  close(fd);
+  if (page == MAP_FAILED) {
+    errno = error;
+    return NULL;
+  }
+  BmStatus* status = calloc(1, sizeof(*status));
+  if (status == NULL) {
+    munmap(page, sizeof(BmStatusPage));
+    return NULL;
+  }
+  status->page = page;
+  return status;
+}
+
+// Function to unmap the status page
+void bm_unmap_status(BmStatus* status) {
+  if (status != NULL) {
+    munmap((void*)status->page, sizeof(BmStatusPage));
+    free(status);
+  }
+}
+
+// Function to copy a consistent snapshot out of the mapped status page
+// Only a page that did not change since the previous snapshot may be left
+// behind by a daemon that exited, so only then the daemon is checked
+int bm_status_snapshot(BmStatus* status, BmStatusPage* snapshot) {
+  if (read_status_snapshot(status->page, snapshot) == -1) {
+    return -1;
+  }
+  // The daemon clears the magic when it exits
+  if (snapshot->magic != BM_STATUS_MAGIC || snapshot->version != BM_STATUS_VERSION) {
+    errno = (snapshot->magic == 0) ? ESRCH : EPROTO;
+    return -1;
+  }
+  if ((!status->seen || snapshot->sequence == status->sequence) && kill(snapshot->pid, 0) == -1 && errno == ESRCH) {
+    return -1;
+  }
+  status->seen = true;
+  status->sequence = snapshot->sequence;
+  return 0;
+}
+
+// Function to read a consistent snapshot of the status page
+// The page is mapped for the call only, readers polling it use bm_map_status
+int bm_read_status(BmStatusPage* snapshot) {
+  BmStatus* status = bm_map_status();
+  if (status == NULL) {
+    return -1;
+  }
+  int result = bm_status_snapshot(status, snapshot);
+  bm_unmap_status(status);
+  return result;
+}